@@ -7,32 +7,33 @@
 #include "coro/switch.h"
 #include "event.h"
 #include "util/list.h"
-#include "util/memcache.h"
-#include "util/rbtree.h"
 #include "util/system.h"
+#include "util/timer_wheel.h"
 
-struct timer_node {
-    struct rb_node node; /* inactive */
-    struct rb_root root; /* coroutines with the same timeout */
-    long long timeout;   /* unit: milliseconds */
-};
+/* stacks idle for longer give their pages back to the system */
+#define STACK_RECLAIM_IDLE (30 * 1000)
+#define STACK_RECLAIM_INTERVAL 1000
 
 struct coroutine {
-    struct list_head list; /* free_pool or active linked list */
-    struct rb_node node;
+    struct list_head list; /* idle, released or active linked list */
+    struct wheel_timer timer;
     int coro_id;
     struct context ctx;
     struct coro_stack stack;
     coro_func func;
     void *args; /* associated with coroutine function */
 
-    long long timeout; /* track the timeout of events */
     bool active_by_timeout;
+    bool waiting; /* off the active list until woken up or timed out */
+    long long idle_since; /* in milliseconds */
+    long long deadline;   /* in milliseconds, 0 for none */
+
+    /* shared stack mode: the used part of the stack while switched out */
+    char *saved;
+    size_t saved_size, saved_cap;
+    bool fresh; /* dispatched, the initial frame is built when it first runs */
 };
 
-/* sched policy, if timeout == -1, sched policy can wait forever */
-typedef void (*sched_policy_t)(int timeout /* in milliseconds */);
-
 struct coro_schedule {
     size_t max_coro_size;
     size_t curr_coro_size;
@@ -40,156 +41,70 @@ struct coro_schedule {
     int next_coro_id;
 
     size_t stack_bytes;
+    struct coroutine *coros; /* descriptors, created in order */
+    struct coro_arena arena;
+    bool shared_stack;
+    struct coro_stack stack;       /* the stack all coroutines run on */
+    struct coroutine *stack_owner; /* whose frames the shared stack holds */
+
     struct coroutine main_coro;
     struct coroutine *current;
 
-    struct list_head idle, active;
-    struct rb_root inactive; /* waiting coroutines */
-    struct memcache *cache;  /* caching timer node */
+    /* Idle coroutines, most recently used first, so that the stack reused is
+     * the one most likely still in cache. Those idle for STACK_RECLAIM_IDLE
+     * have their stack pages released and move to the released list.
+     */
+    struct list_head idle, released;
+    long long next_reclaim;
+
+    struct list_head active;
+    struct timer_wheel inactive; /* waiting coroutines */
 
     sched_policy_t policy;
 };
 
 static struct coro_schedule sched;
 
-static struct coroutine *find_in_timer(struct timer_node *tm_node, int coro_id)
+static inline void remove_from_inactive(struct coroutine *coro)
 {
-    struct rb_node *each = tm_node->root.rb_node;
-
-    while (each) {
-        struct coroutine *coro = container_of(each, struct coroutine, node);
-
-        int result = coro_id - coro->coro_id;
-        if (result < 0)
-            each = each->rb_left;
-        else if (result > 0)
-            each = each->rb_right;
-        else
-            return coro;
-    }
-
-    return NULL;
+    timer_wheel_del(&sched.inactive, &coro->timer);
 }
 
-static inline void remove_from_timer_node(struct timer_node *tm_node,
-                                          struct coroutine *coro)
+static inline void move_to_inactive(struct coroutine *coro)
 {
-    if (!find_in_timer(tm_node, coro->coro_id))
-        return;
-
-    rb_erase(&coro->node, &tm_node->root);
-}
-
-static struct timer_node *find_timer_node(long long timeout)
-{
-    struct rb_node *each = sched.inactive.rb_node;
-
-    while (each) {
-        struct timer_node *tm_node =
-            container_of(each, struct timer_node, node);
-        long long timespan = timeout - tm_node->timeout;
-        if (timespan < 0)
-            each = each->rb_left;
-        else if (timespan > 0)
-            each = each->rb_right;
-        else
-            return tm_node;
-    }
-
-    return NULL;
-}
-
-static inline void remove_from_inactive_tree(struct coroutine *coro)
-{
-    struct timer_node *tm_node = find_timer_node(coro->timeout);
-    if (!tm_node)
-        return;
-
-    remove_from_timer_node(tm_node, coro);
-
-    if (RB_EMPTY_ROOT(&tm_node->root)) {
-        rb_erase(&tm_node->node, &sched.inactive);
-        memcache_free(sched.cache, tm_node);
-    }
-}
-
-static void add_to_timer_node(struct timer_node *tm_node,
-                              struct coroutine *coro)
-{
-    struct rb_node **newer = &tm_node->root.rb_node, *parent = NULL;
-
-    while (*newer) {
-        struct coroutine *each = container_of(*newer, struct coroutine, node);
-        int result = coro->coro_id - each->coro_id;
-        parent = *newer;
-
-        newer = (result < 0) ? &(*newer)->rb_left : &(*newer)->rb_right;
-    }
-
-    rb_link_node(&coro->node, parent, newer);
-    rb_insert_color(&coro->node, &tm_node->root);
-}
-
-static void move_to_inactive_tree(struct coroutine *coro)
-{
-    struct rb_node **newer = &sched.inactive.rb_node, *parent = NULL;
-
-    while (*newer) {
-        struct timer_node *tm_node =
-            container_of(*newer, struct timer_node, node);
-        int timespan = coro->timeout - tm_node->timeout;
-
-        parent = *newer;
-        if (timespan < 0)
-            newer = &(*newer)->rb_left;
-        else if (timespan > 0)
-            newer = &(*newer)->rb_right;
-        else {
-            add_to_timer_node(tm_node, coro);
-            return;
-        }
-    }
-
-    struct timer_node *tmp = memcache_alloc(sched.cache);
-    if (unlikely(!tmp)) /* still in active list */
-        return;
-    tmp->root = RB_ROOT;
-    tmp->node.rb_left = NULL;
-    tmp->node.rb_right = NULL;
-
-    tmp->timeout = coro->timeout;
-    add_to_timer_node(tmp, coro);
-    rb_link_node(&tmp->node, parent, newer);
-    rb_insert_color(&tmp->node, &sched.inactive);
+    coro->waiting = true;
+    timer_wheel_add(&sched.inactive, &coro->timer);
 }
 
 static inline void move_to_idle_list_direct(struct coroutine *coro)
 {
-    list_add_tail(&coro->list, &sched.idle);
+    coro->idle_since = get_curr_mseconds();
+    list_add(&coro->list, &sched.idle);
 }
 
 static inline void move_to_active_list_tail_direct(struct coroutine *coro)
 {
+    coro->waiting = false;
     list_add_tail(&coro->list, &sched.active);
 }
 
 static inline void move_to_active_list_tail(struct coroutine *coro)
 {
-    remove_from_inactive_tree(coro);
-    list_add_tail(&coro->list, &sched.active);
+    remove_from_inactive(coro);
+    move_to_active_list_tail_direct(coro);
 }
 
 static inline void move_to_active_list_head(struct coroutine *coro)
 {
-    remove_from_inactive_tree(coro);
+    remove_from_inactive(coro);
+    coro->waiting = false;
     list_add(&coro->list, &sched.active);
 }
 
 static inline void coroutine_init(struct coroutine *coro)
 {
     INIT_LIST_HEAD(&coro->list);
-    RB_CLEAR_NODE(&coro->node);
-    coro->timeout = 0;
+    wheel_timer_init(&coro->timer);
     coro->active_by_timeout = false;
 }
 
@@ -198,15 +113,11 @@ static struct coroutine *create_coroutine()
     if (unlikely(sched.curr_coro_size == sched.max_coro_size))
         return NULL;
 
-    struct coroutine *coro = malloc(sizeof(struct coroutine));
-    if (unlikely(!coro))
+    struct coroutine *coro = &sched.coros[sched.curr_coro_size];
+    if (!sched.shared_stack &&
+        coro_arena_stack(&sched.arena, sched.curr_coro_size, &coro->stack))
         return NULL;
 
-    if (coro_stack_alloc(&coro->stack, sched.stack_bytes)) {
-        free(coro);
-        return NULL;
-    }
-
     coro->coro_id = ++sched.next_coro_id;
     sched.curr_coro_size++;
 
@@ -216,9 +127,13 @@ static struct coroutine *create_coroutine()
 static struct coroutine *get_coroutine()
 {
     struct coroutine *coro;
+    struct list_head *idle = &sched.idle;
 
-    if (!list_empty(&sched.idle)) {
-        coro = list_first_entry(&sched.idle, struct coroutine, list);
+    if (list_empty(idle))
+        idle = &sched.released;
+
+    if (!list_empty(idle)) {
+        coro = list_first_entry(idle, struct coroutine, list);
         list_del(&coro->list);
         coroutine_init(coro);
 
@@ -251,63 +166,133 @@ static inline struct coroutine *get_active_coroutine()
     return coro;
 }
 
-static inline void run_active_coroutine()
+static ATTRIBUTE_REGPARM(1) void coro_routine_proxy(void *args);
+
+/* Copy the live frames of @coro, from its saved stack pointer up to the top
+ * of the shared stack, into a heap buffer sized to them.
+ */
+static void save_stack(struct coroutine *coro)
 {
-    struct coroutine *coro;
+    size_t size = (char *) sched.stack.ptr - (char *) coro->ctx.sp;
+
+    if (size > coro->saved_cap || size < coro->saved_cap / 4) {
+        size_t cap = ALIGN(size, 512);
+        char *saved = realloc(coro->saved, cap);
+        if (!saved) {
+            printf("Failed to save coroutine stack of %zu bytes\n", size);
+            exit(0);
+        }
 
-    while ((coro = get_active_coroutine()))
-        coroutine_switch(&sched.main_coro, coro);
+        coro->saved = saved;
+        coro->saved_cap = cap;
+    }
+
+    memcpy(coro->saved, coro->ctx.sp, size);
+    coro->saved_size = size;
 }
 
-static inline struct timer_node *get_recent_timer_node()
+/* Runs on the scheduler stack. The owner is only saved once another
+ * coroutine needs the shared stack, so a coroutine resumed right after it
+ * yielded costs no copy at all.
+ */
+static void restore_stack(struct coroutine *coro)
 {
-    struct rb_node *recent = rb_first(&sched.inactive);
-    if (!recent)
-        return NULL;
+    struct coroutine *owner = sched.stack_owner;
+
+    if (owner == coro)
+        return;
+
+    if (owner)
+        save_stack(owner);
+    sched.stack_owner = coro;
+
+    if (coro->fresh) {
+        coro->fresh = false;
+        coro_stack_init(&coro->ctx, &sched.stack, coro_routine_proxy, coro);
+        return;
+    }
 
-    return container_of(recent, struct timer_node, node);
+    memcpy(coro->ctx.sp, coro->saved, coro->saved_size);
 }
 
-static inline void timeout_coroutine_handler(struct timer_node *node)
+/* Hand the CPU from @curr straight to the next active coroutine, saving the
+ * round trip through the scheduler. Only when none is left, or when stacks
+ * are shared and have to be restored from the scheduler stack, does control
+ * go back to the scheduler, which then polls for events.
+ */
+static void coroutine_yield(struct coroutine *curr)
 {
-    struct rb_node *recent;
+    struct coroutine *next = NULL;
 
-    while ((recent = node->root.rb_node)) {
-        struct coroutine *coro = container_of(recent, struct coroutine, node);
-        rb_erase(recent, &node->root);
-        coro->active_by_timeout = true;
-        move_to_active_list_tail_direct(coro);
+    if (!sched.shared_stack)
+        next = get_active_coroutine();
+
+    coroutine_switch(curr, next ? next : &sched.main_coro);
+}
+
+static inline void run_active_coroutine()
+{
+    struct coroutine *coro;
+
+    while ((coro = get_active_coroutine())) {
+        if (sched.shared_stack)
+            restore_stack(coro);
+        coroutine_switch(&sched.main_coro, coro);
     }
 }
 
-static void check_timeout_coroutine()
+static void timeout_coroutine_handler(struct wheel_timer *timer)
 {
-    struct timer_node *node;
-    long long now = get_curr_mseconds();
+    struct coroutine *coro = container_of(timer, struct coroutine, timer);
 
-    while ((node = get_recent_timer_node())) {
-        if (now < node->timeout)
-            return;
+    coro->active_by_timeout = true;
+    list_del_init(&coro->list); /* from the wait queue it gave up on */
+    move_to_active_list_tail_direct(coro);
+}
 
-        rb_erase(&node->node, &sched.inactive);
-        timeout_coroutine_handler(node);
-        memcache_free(sched.cache, node);
-    }
+static inline void check_timeout_coroutine()
+{
+    timer_wheel_advance(&sched.inactive, get_curr_mseconds(),
+                        timeout_coroutine_handler);
 }
 
 static inline int get_recent_timespan()
 {
-    struct timer_node *node = get_recent_timer_node();
-    if (!node)
+    long long recent = timer_wheel_next(&sched.inactive);
+    if (recent < 0)
         return 10 * 1000; /* at least 10 seconds */
 
-    int timespan = node->timeout - get_curr_mseconds();
+    long long timespan = recent - get_curr_mseconds();
     return (timespan < 0) ? 0 : timespan;
 }
 
+/* The coldest idle stacks are at the tail of the idle list. Shared stack
+ * mode has nothing to release, saved frames are freed on exit.
+ */
+static void reclaim_idle_stacks()
+{
+    long long now = get_curr_mseconds();
+
+    if (sched.shared_stack || now < sched.next_reclaim)
+        return;
+    sched.next_reclaim = now + STACK_RECLAIM_INTERVAL;
+
+    while (!list_empty(&sched.idle)) {
+        struct coroutine *coro =
+            list_entry(sched.idle.prev, struct coroutine, list);
+        if (now - coro->idle_since < STACK_RECLAIM_IDLE)
+            break;
+
+        list_del(&coro->list);
+        coro_stack_release(&coro->stack);
+        list_add(&coro->list, &sched.released);
+    }
+}
+
 void schedule_cycle()
 {
     for (;;) {
+        reclaim_idle_stacks();
         check_timeout_coroutine();
         run_active_coroutine();
 
@@ -322,30 +307,76 @@ static ATTRIBUTE_REGPARM(1) void coro_routine_proxy(void *args)
 
     coro->func(coro->args);
     move_to_idle_list_direct(coro);
-    coroutine_switch(sched.current, &sched.main_coro);
+
+    if (sched.shared_stack) { /* nothing left worth saving */
+        sched.stack_owner = NULL;
+        free(coro->saved);
+        coro->saved = NULL;
+        coro->saved_size = coro->saved_cap = 0;
+    }
+    coroutine_yield(coro);
 }
 
-int dispatch_coro(coro_func func, void *args)
+static struct coroutine *new_coroutine(coro_func func, void *args)
 {
     struct coroutine *coro = get_coroutine();
     if (unlikely(!coro))
-        return -1;
+        return NULL;
 
     coro->func = func, coro->args = args;
+    coro->deadline = 0;
 
-    coro_stack_init(&coro->ctx, &coro->stack, coro_routine_proxy, coro);
+    /* the caller may be running on the shared stack right now */
+    if (sched.shared_stack)
+        coro->fresh = true;
+    else
+        coro_stack_init(&coro->ctx, &coro->stack, coro_routine_proxy, coro);
     move_to_active_list_tail_direct(coro);
 
-    return 0;
+    return coro;
+}
+
+int dispatch_coro(coro_func func, void *args)
+{
+    return new_coroutine(func, args) ? 0 : -1;
+}
+
+/* Like dispatch_coro(), but the new coroutine is bound by the deadline of
+ * the current one. Return it, NULL if there is none left.
+ */
+void *spawn_coro(coro_func func, void *args)
+{
+    struct coroutine *coro = new_coroutine(func, args);
+
+    if (coro && sched.current)
+        coro->deadline = sched.current->deadline;
+
+    return coro;
+}
+
+/* Put @coro past its deadline, so that its blocking calls fail with ETIME,
+ * and wake it up if it is waiting for something. @coro must not have exited.
+ */
+void cancel_coro(void *args)
+{
+    struct coroutine *coro = args;
+
+    coro->deadline = get_curr_mseconds();
+    if (!coro->waiting)
+        return;
+
+    list_del_init(&coro->list); /* from a wait queue, if any */
+    coro->active_by_timeout = true;
+    move_to_active_list_tail(coro);
 }
 
 void schedule_timeout(int milliseconds)
 {
     struct coroutine *coro = sched.current;
 
-    coro->timeout = get_curr_mseconds() + milliseconds;
-    move_to_inactive_tree(coro);
-    coroutine_switch(sched.current, &sched.main_coro);
+    coro->timer.expires = get_curr_mseconds() + milliseconds;
+    move_to_inactive(coro);
+    coroutine_yield(coro);
 }
 
 bool is_wakeup_by_timeout()
@@ -377,8 +408,104 @@ void *current_coro()
     return sched.current;
 }
 
-/* @stack_bytes should be aligned to PAGE_SIZE */
-void schedule_init(size_t stack_kbytes, size_t max_coro_size)
+/* false in the scheduler itself and before it runs, e.g. in the master */
+bool in_coroutine()
+{
+    return sched.current && sched.current != &sched.main_coro;
+}
+
+void wait_queue_init(struct wait_queue *q)
+{
+    INIT_LIST_HEAD(&q->waiters);
+}
+
+/* Park the current coroutine on @q until it is woken through @q or, unless
+ * @milliseconds is negative, the time is up. Return 0 if woken, -1 on timeout.
+ */
+int wait_queue_sleep(struct wait_queue *q, int milliseconds)
+{
+    struct coroutine *coro = sched.current;
+
+    list_add_tail(&coro->list, &q->waiters);
+    coro->waiting = true;
+    if (milliseconds >= 0) {
+        coro->timer.expires = get_curr_mseconds() + milliseconds;
+        move_to_inactive(coro);
+    }
+    coroutine_yield(coro);
+
+    return is_wakeup_by_timeout() ? -1 : 0;
+}
+
+/* Wake the longest waiting coroutine of @q. Return it, NULL if none. */
+void *wait_queue_wake(struct wait_queue *q)
+{
+    if (list_empty(&q->waiters))
+        return NULL;
+
+    struct coroutine *coro =
+        list_first_entry(&q->waiters, struct coroutine, list);
+    list_del_init(&coro->list);
+    wakeup_coro(coro);
+
+    return coro;
+}
+
+void wait_queue_wake_all(struct wait_queue *q)
+{
+    while (wait_queue_wake(q))
+        ;
+}
+
+/* Blocking calls of the current coroutine made within @milliseconds from now
+ * must complete before it is over; 0 removes the deadline.
+ */
+void set_coro_deadline(int milliseconds)
+{
+    sched.current->deadline =
+        milliseconds > 0 ? get_curr_mseconds() + milliseconds : 0;
+}
+
+/* The deadline of the current coroutine, 0 if none, to be put back later
+ * with restore_coro_deadline() after a tighter one.
+ */
+long long get_coro_deadline()
+{
+    return sched.current ? sched.current->deadline : 0;
+}
+
+void restore_coro_deadline(long long deadline)
+{
+    sched.current->deadline = deadline;
+}
+
+/* @milliseconds cut to what is left of the current coroutine's deadline.
+ * Return -1 if the deadline has passed.
+ */
+int coro_timeout(int milliseconds)
+{
+    if (!sched.current || !sched.current->deadline)
+        return milliseconds;
+
+    long long left = sched.current->deadline - get_curr_mseconds();
+    if (left <= 0)
+        return -1;
+
+    return left < milliseconds ? left : milliseconds;
+}
+
+/* replace the default event_cycle, e.g. by another I/O engine */
+void set_sched_policy(sched_policy_t policy)
+{
+    sched.policy = policy;
+}
+
+/* @stack_kbytes should be aligned to PAGE_SIZE. With @shared_stack, it is the
+ * size of the one stack every coroutine runs on.
+ */
+void schedule_init(size_t stack_kbytes,
+                   size_t max_coro_size,
+                   bool shared_stack)
 {
     assert(max_coro_size >= 2);
 
@@ -389,13 +516,29 @@ void schedule_init(size_t stack_kbytes, size_t max_coro_size)
     sched.stack_bytes = stack_kbytes * 1024;
     sched.current = NULL;
 
+    sched.coros = calloc(max_coro_size, sizeof(struct coroutine));
+    if (!sched.coros) {
+        printf("Failed to allocate coroutines\n");
+        exit(0);
+    }
+
+    sched.shared_stack = shared_stack;
+    sched.stack_owner = NULL;
+    if (shared_stack && coro_stack_alloc(&sched.stack, sched.stack_bytes)) {
+        printf("Failed to allocate shared coroutine stack\n");
+        exit(0);
+    }
+
+    if (!shared_stack &&
+        coro_arena_init(&sched.arena, sched.stack_bytes, max_coro_size)) {
+        printf("Failed to reserve coroutine stacks\n");
+        exit(0);
+    }
+
     INIT_LIST_HEAD(&sched.idle);
+    INIT_LIST_HEAD(&sched.released);
+    sched.next_reclaim = 0;
     INIT_LIST_HEAD(&sched.active);
-    sched.inactive = RB_ROOT;
-    sched.cache = memcache_create(sizeof(struct timer_node), max_coro_size / 2);
+    timer_wheel_init(&sched.inactive, get_curr_mseconds());
     sched.policy = event_cycle;
-    if (!sched.cache) {
-        printf("Failed to create cache for schedule timer node\n");
-        exit(0);
-    }
 }
@@ -2,15 +2,44 @@
 
 #include <stdbool.h>
 
+#include "util/list.h"
+
 typedef void (*coro_func)(void *args);
 
+/* sched policy, if timeout == -1, sched policy can wait forever */
+typedef void (*sched_policy_t)(int timeout /* in milliseconds */);
+
 void schedule_cycle();
 int dispatch_coro(coro_func func, void *args);
+void *spawn_coro(coro_func func, void *args);
+void cancel_coro(void *coro);
 void schedule_timeout(int milliseconds);
 bool is_wakeup_by_timeout();
 
 void wakeup_coro(void *args);
 void wakeup_coro_priority(void *args);
 void *current_coro();
+bool in_coroutine();
+
+/* Coroutines waiting for one another, woken in FIFO order. A waiting
+ * coroutine is linked through its own descriptor, so a queue costs no memory
+ * per waiter, but the queue itself must outlive its waiters.
+ */
+struct wait_queue {
+    struct list_head waiters;
+};
+
+void wait_queue_init(struct wait_queue *q);
+int wait_queue_sleep(struct wait_queue *q, int milliseconds);
+void *wait_queue_wake(struct wait_queue *q);
+void wait_queue_wake_all(struct wait_queue *q);
+
+void set_coro_deadline(int milliseconds);
+int coro_timeout(int milliseconds);
+long long get_coro_deadline();
+void restore_coro_deadline(long long deadline);
 
-void schedule_init(size_t stack_kbytes, size_t max_coro_size);
+void set_sched_policy(sched_policy_t policy);
+void schedule_init(size_t stack_kbytes,
+                   size_t max_coro_size,
+                   bool shared_stack);
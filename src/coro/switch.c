@@ -1,9 +1,15 @@
+#include <errno.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <sys/mman.h>
 
 #include "coro/switch.h"
 #include "util/system.h"
 
+#ifndef MADV_GUARD_INSTALL
+#define MADV_GUARD_INSTALL 102 /* Linux 6.13 */
+#endif
+
 __asm__(
     ".text\n"
     ".globl context_switch\n"
@@ -110,3 +116,52 @@ void coro_stack_free(struct coro_stack *stack)
         (void *) ((char *) stack->ptr - stack->size_bytes - get_page_size());
     munmap(stack->ptr, stack->size_bytes + get_page_size());
 }
+
+/* ensure size_bytes aligned by get_page_size(). Only address space is
+ * reserved here.
+ */
+int coro_arena_init(struct coro_arena *arena, size_t size_bytes, size_t count)
+{
+    arena->stack_bytes = size_bytes;
+    arena->slot_bytes = size_bytes + get_page_size();
+
+    arena->base = mmap(NULL, arena->slot_bytes * count, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (arena->base == (void *) -1)
+        return -1;
+
+    return 0;
+}
+
+/* Hand out the stack of slot @index, installing its guard page. Guard
+ * regions keep the arena a single mapping, mprotect() splits it around every
+ * guard page on kernels without them.
+ */
+int coro_arena_stack(struct coro_arena *arena,
+                     size_t index,
+                     struct coro_stack *stack)
+{
+    static bool guard_regions = true;
+    char *slot = arena->base + index * arena->slot_bytes;
+
+    if (guard_regions && madvise(slot, get_page_size(), MADV_GUARD_INSTALL)) {
+        if (errno != EINVAL)
+            return -1;
+        guard_regions = false;
+    }
+
+    if (!guard_regions && mprotect(slot, get_page_size(), PROT_NONE))
+        return -1;
+
+    stack->size_bytes = arena->stack_bytes;
+    stack->ptr = slot + arena->slot_bytes;
+
+    return 0;
+}
+
+/* Give the pages of an unused stack back, they read as zero afterwards */
+void coro_stack_release(struct coro_stack *stack)
+{
+    madvise((char *) stack->ptr - stack->size_bytes, stack->size_bytes,
+            MADV_DONTNEED);
+}
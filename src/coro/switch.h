@@ -5,6 +5,15 @@ struct coro_stack {
     size_t size_bytes;
 };
 
+/* One reservation holding the stacks of all coroutines of a worker. Slot i is
+ * a guard page followed by the stack, the pages are backed on first touch.
+ */
+struct coro_arena {
+    char *base;
+    size_t slot_bytes;
+    size_t stack_bytes;
+};
+
 struct context {
     void **sp; /* current coroutine's top stack. equivalent to %esp / %rsp */
 };
@@ -20,3 +29,9 @@ void coro_stack_init(struct context *ctx,
                      void *args);
 int coro_stack_alloc(struct coro_stack *stack, size_t size_bytes);
 void coro_stack_free(struct coro_stack *stack);
+
+int coro_arena_init(struct coro_arena *arena, size_t size_bytes, size_t count);
+int coro_arena_stack(struct coro_arena *arena,
+                     size_t index,
+                     struct coro_stack *stack);
+void coro_stack_release(struct coro_stack *stack);
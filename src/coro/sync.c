@@ -0,0 +1,324 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+
+#include "coro/sync.h"
+#include "util/system.h"
+
+static inline long long wait_until(int milliseconds)
+{
+    return milliseconds < 0 ? -1 : get_curr_mseconds() + milliseconds;
+}
+
+/* Sleep on @q until woken, or until @until unless it is negative, and never
+ * past the deadline of the current coroutine. Return 0 if woken, -1 on
+ * timeout.
+ */
+static int wait_on(struct wait_queue *q, long long until)
+{
+    long long left = INT_MAX;
+    int timeout = -1;
+
+    if (until < 0 || (left = until - get_curr_mseconds()) > 0)
+        timeout = coro_timeout(left < INT_MAX ? left : INT_MAX);
+
+    if (timeout < 0) {
+        errno = ETIME;
+        return -1;
+    }
+
+    /* neither a limit nor a deadline, only a wakeup ends the wait */
+    if (until < 0 && timeout == INT_MAX)
+        timeout = -1;
+
+    if (wait_queue_sleep(q, timeout)) {
+        errno = ETIME;
+        return -1;
+    }
+
+    return 0;
+}
+
+void coro_mutex_init(struct coro_mutex *m)
+{
+    m->owner = NULL;
+    wait_queue_init(&m->waiters);
+}
+
+int coro_mutex_lock(struct coro_mutex *m, int milliseconds)
+{
+    if (!m->owner) {
+        m->owner = current_coro();
+        return 0;
+    }
+
+    /* woken up by unlock, the mutex is ours already */
+    return wait_on(&m->waiters, wait_until(milliseconds));
+}
+
+void coro_mutex_unlock(struct coro_mutex *m)
+{
+    m->owner = wait_queue_wake(&m->waiters);
+}
+
+void coro_sem_init(struct coro_sem *s, int count)
+{
+    s->count = count;
+    wait_queue_init(&s->waiters);
+}
+
+int coro_sem_wait(struct coro_sem *s, int milliseconds)
+{
+    if (s->count > 0) {
+        s->count--;
+        return 0;
+    }
+
+    /* woken up by post, which handed its unit over */
+    return wait_on(&s->waiters, wait_until(milliseconds));
+}
+
+void coro_sem_post(struct coro_sem *s)
+{
+    if (!wait_queue_wake(&s->waiters))
+        s->count++;
+}
+
+int coro_chan_init(struct coro_chan *ch, size_t capacity)
+{
+    if (!capacity) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ch->items = malloc(capacity * sizeof(void *));
+    if (!ch->items)
+        return -1;
+
+    ch->capacity = capacity;
+    ch->head = ch->len = 0;
+    ch->closed = false;
+    wait_queue_init(&ch->senders);
+    wait_queue_init(&ch->receivers);
+
+    return 0;
+}
+
+void coro_chan_destroy(struct coro_chan *ch)
+{
+    free(ch->items);
+    ch->items = NULL;
+}
+
+/* A woken waiter may still find the channel full, or empty, if a running
+ * coroutine got there first: it waits again for what is left of its time.
+ */
+int coro_chan_send(struct coro_chan *ch, void *item, int milliseconds)
+{
+    long long until = wait_until(milliseconds);
+
+    while (!ch->closed && ch->len == ch->capacity) {
+        if (wait_on(&ch->senders, until))
+            return -1;
+    }
+
+    if (ch->closed) {
+        errno = EPIPE;
+        return -2;
+    }
+
+    ch->items[(ch->head + ch->len++) % ch->capacity] = item;
+    wait_queue_wake(&ch->receivers);
+
+    return 0;
+}
+
+int coro_chan_recv(struct coro_chan *ch, void **item, int milliseconds)
+{
+    long long until = wait_until(milliseconds);
+
+    while (!ch->closed && !ch->len) {
+        if (wait_on(&ch->receivers, until))
+            return -1;
+    }
+
+    if (!ch->len) {
+        errno = EPIPE;
+        return -2;
+    }
+
+    *item = ch->items[ch->head];
+    ch->head = (ch->head + 1) % ch->capacity;
+    ch->len--;
+    wait_queue_wake(&ch->senders);
+
+    return 0;
+}
+
+void coro_chan_close(struct coro_chan *ch)
+{
+    ch->closed = true;
+    wait_queue_wake_all(&ch->senders);
+    wait_queue_wake_all(&ch->receivers);
+}
+
+void coro_wait_group_init(struct coro_wait_group *wg)
+{
+    wg->count = 0;
+    wait_queue_init(&wg->waiters);
+}
+
+void coro_wait_group_add(struct coro_wait_group *wg, int n)
+{
+    wg->count += n;
+    if (wg->count <= 0) {
+        wg->count = 0;
+        wait_queue_wake_all(&wg->waiters);
+    }
+}
+
+void coro_wait_group_done(struct coro_wait_group *wg)
+{
+    coro_wait_group_add(wg, -1);
+}
+
+int coro_wait_group_wait(struct coro_wait_group *wg, int milliseconds)
+{
+    if (!wg->count)
+        return 0;
+
+    return wait_on(&wg->waiters, wait_until(milliseconds));
+}
+
+/* Kept off the stacks, both the parent's and the child's may be shared */
+struct group_child {
+    struct list_head list;
+    struct coro_group *group;
+    coro_func func;
+    void *args;
+    void *coro;
+    int index;
+};
+
+void coro_group_init(struct coro_group *g)
+{
+    INIT_LIST_HEAD(&g->running);
+    g->spawned = 0;
+    g->first = -1;
+    wait_queue_init(&g->waiters);
+}
+
+static void group_child_main(void *args)
+{
+    struct group_child *child = args;
+    struct coro_group *g = child->group;
+
+    child->func(child->args);
+
+    list_del(&child->list);
+    if (g->first < 0)
+        g->first = child->index;
+    free(child);
+
+    wait_queue_wake_all(&g->waiters);
+}
+
+/* Run @func(@args) in a child coroutine. Return the index of the child, -1
+ * if it could not be created.
+ */
+int coro_group_spawn(struct coro_group *g, coro_func func, void *args)
+{
+    struct group_child *child = malloc(sizeof(struct group_child));
+    if (!child)
+        return -1;
+
+    child->group = g;
+    child->func = func;
+    child->args = args;
+    child->coro = spawn_coro(group_child_main, child);
+    if (!child->coro) {
+        free(child);
+        errno = EAGAIN;
+        return -1;
+    }
+
+    child->index = g->spawned++;
+    list_add_tail(&child->list, &g->running);
+
+    return child->index;
+}
+
+int coro_group_wait_all(struct coro_group *g, int milliseconds)
+{
+    long long until = wait_until(milliseconds);
+
+    while (!list_empty(&g->running)) {
+        if (wait_on(&g->waiters, until))
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Return the index of the first child to finish, -1 on timeout or if no
+ * child was spawned.
+ */
+int coro_group_wait_any(struct coro_group *g, int milliseconds)
+{
+    long long until = wait_until(milliseconds);
+
+    if (!g->spawned) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    while (g->first < 0) {
+        if (wait_on(&g->waiters, until))
+            return -1;
+    }
+
+    return g->first;
+}
+
+/* Cancel the children still running and wait until they have finished: their
+ * blocking calls fail with ETIME from now on, and they are expected to give
+ * up. This wait ignores timeouts, the group can go away afterwards.
+ */
+void coro_group_cancel(struct coro_group *g)
+{
+    struct group_child *child;
+
+    list_for_each_entry(child, &g->running, list)
+        cancel_coro(child->coro);
+
+    while (!list_empty(&g->running))
+        wait_queue_sleep(&g->waiters, -1);
+}
+
+/* Return -1 if the sleep was cut short by the deadline of the coroutine, or
+ * by its cancellation.
+ */
+int coro_sleep(int milliseconds)
+{
+    long long start = get_curr_mseconds();
+
+    int timeout = coro_timeout(milliseconds > 0 ? milliseconds : 0);
+    if (timeout >= 0) {
+        schedule_timeout(timeout);
+        is_wakeup_by_timeout();
+    }
+
+    if (get_curr_mseconds() - start < milliseconds) {
+        errno = ETIME;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Let the other runnable coroutines, and the event loop, go first */
+void coro_yield()
+{
+    schedule_timeout(0);
+    is_wakeup_by_timeout();
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "coro/sched.h"
+#include "util/list.h"
+
+/* Coordination between the coroutines of one worker. Waiting coroutines are
+ * parked on wait queues of the scheduler, nothing here enters the kernel.
+ *
+ * @milliseconds of the calls below: negative waits as long as it takes, 0
+ * does not wait at all. A deadline of the coroutine ends any wait. Calls
+ * that time out return -1 with errno ETIME.
+ *
+ * With a shared coroutine stack these objects must not live on a stack.
+ */
+
+/* Ownership passes straight to the longest waiter on unlock */
+struct coro_mutex {
+    void *owner;
+    struct wait_queue waiters;
+};
+
+void coro_mutex_init(struct coro_mutex *m);
+int coro_mutex_lock(struct coro_mutex *m, int milliseconds);
+void coro_mutex_unlock(struct coro_mutex *m);
+
+/* Counting semaphore, e.g. to cap the requests in flight to a backend */
+struct coro_sem {
+    int count;
+    struct wait_queue waiters;
+};
+
+void coro_sem_init(struct coro_sem *s, int count);
+int coro_sem_wait(struct coro_sem *s, int milliseconds);
+void coro_sem_post(struct coro_sem *s);
+
+/* Bounded FIFO of pointers. Once closed, sends fail and receives drain what
+ * is left, then fail: both return -2 with errno EPIPE.
+ */
+struct coro_chan {
+    void **items;
+    size_t capacity, head, len;
+    bool closed;
+    struct wait_queue senders, receivers;
+};
+
+int coro_chan_init(struct coro_chan *ch, size_t capacity);
+void coro_chan_destroy(struct coro_chan *ch);
+int coro_chan_send(struct coro_chan *ch, void *item, int milliseconds);
+int coro_chan_recv(struct coro_chan *ch, void **item, int milliseconds);
+void coro_chan_close(struct coro_chan *ch);
+
+/* Wait for a number of tasks, typically coroutines dispatched for them */
+struct coro_wait_group {
+    int count;
+    struct wait_queue waiters;
+};
+
+void coro_wait_group_init(struct coro_wait_group *wg);
+void coro_wait_group_add(struct coro_wait_group *wg, int n);
+void coro_wait_group_done(struct coro_wait_group *wg);
+int coro_wait_group_wait(struct coro_wait_group *wg, int milliseconds);
+
+/* Child coroutines spawned to work in parallel, e.g. one per backend queried
+ * by a request. Children are bound by the deadline of the coroutine that
+ * spawned them, and are told apart by their index, in spawn order. The group
+ * must not go away before every child has finished: wait for all of them, or
+ * cancel the rest.
+ */
+struct coro_group {
+    struct list_head running; /* children not finished yet */
+    int spawned;
+    int first; /* index of the first child to finish, -1 if none yet */
+    struct wait_queue waiters;
+};
+
+void coro_group_init(struct coro_group *g);
+int coro_group_spawn(struct coro_group *g, coro_func func, void *args);
+int coro_group_wait_all(struct coro_group *g, int milliseconds);
+int coro_group_wait_any(struct coro_group *g, int milliseconds);
+void coro_group_cancel(struct coro_group *g);
+
+int coro_sleep(int milliseconds);
+void coro_yield();
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "env.h"
@@ -13,9 +14,21 @@ char *g_log_strlevel;
 int g_worker_processes;   /* number of worker processes. Default: cpu number. */
 int g_worker_connections; /* Connection limit of each worker */
 int g_coro_stack_kbytes;  /* stack size of coroutine in KiB */
+int g_coro_shared_stack;  /* coroutines run on one stack, copied on switch */
+int g_edge_triggered;     /* register connections once with EPOLLET */
+int g_io_uring;           /* io_uring instead of epoll as event engine */
+int g_file_io_threads;    /* threads running blocking file calls, per worker */
 
 char *g_server_addr; /* TCP server address */
 int g_server_port;   /* server port */
+int g_reuse_port;    /* each worker owns a SO_REUSEPORT listen socket */
+int g_accept_batch;  /* max connections accepted per wakeup */
+
+/* how long a hooked call may wait for its socket, in milliseconds */
+int g_connect_timeout;
+int g_accept_timeout;
+int g_read_timeout;
+int g_write_timeout;
 
 static void set_log_env()
 {
@@ -43,38 +56,155 @@ static void set_worker_env()
         exit(0);
     }
 
-    /* coroutine stack size */
+    c = get_conf_entry("coroutine_shared_stack");
+    if (str_equal(c, "on"))
+        g_coro_shared_stack = 1;
+    else if (str_equal(c, "off"))
+        g_coro_shared_stack = 0;
+    else {
+        printf("check coroutine_shared_stack config: %s, should be on or off\n",
+               c);
+        exit(0);
+    }
+
+    /* coroutine stack size, a shared stack defaults to 256 KiB */
     c = get_conf_entry("coroutine_stack_kbytes");
-    g_coro_stack_kbytes = str_equal(c, "default")
-                              ? get_page_size() >> 10
-                              : ALIGN(atoi(c) * 1024, get_page_size()) >> 10;
+    if (str_equal(c, "default"))
+        g_coro_stack_kbytes = g_coro_shared_stack ? 256 : get_page_size() >> 10;
+    else
+        g_coro_stack_kbytes = ALIGN(atoi(c) * 1024, get_page_size()) >> 10;
     if (g_coro_stack_kbytes <= 0 || g_coro_stack_kbytes > 10240) {
         printf("check coroutine_stack_kbytes: %d, should [%dKiB~10MiB]\n",
                g_coro_stack_kbytes, get_page_size() >> 10);
         exit(0);
     }
+
+    /* event notification mode */
+    c = get_conf_entry("edge_triggered");
+    if (str_equal(c, "on"))
+        g_edge_triggered = 1;
+    else if (str_equal(c, "off"))
+        g_edge_triggered = 0;
+    else {
+        printf("check edge_triggered config: %s, should be on or off\n", c);
+        exit(0);
+    }
+
+    c = get_conf_entry("event_engine");
+    if (str_equal(c, "io_uring"))
+        g_io_uring = 1;
+    else if (str_equal(c, "epoll"))
+        g_io_uring = 0;
+    else {
+        printf("check event_engine config: %s, should be epoll or io_uring\n",
+               c);
+        exit(0);
+    }
+
+    if (g_io_uring && g_edge_triggered) {
+        printf("edge_triggered applies to the epoll engine only\n");
+        exit(0);
+    }
+
+    /* the kernel fills io_uring buffers while their coroutines are away */
+    if (g_io_uring && g_coro_shared_stack) {
+        printf("coroutine_shared_stack applies to the epoll engine only\n");
+        exit(0);
+    }
+
+    c = get_conf_entry("file_io_threads");
+    if (str_equal(c, "default"))
+        g_file_io_threads = g_coro_shared_stack ? 0 : 4;
+    else
+        g_file_io_threads = atoi(c);
+    if (g_file_io_threads < 0 || g_file_io_threads > 64) {
+        printf("check file_io_threads config: %d, should default or [0~64]\n",
+               g_file_io_threads);
+        exit(0);
+    }
+
+    /* pool threads write to the stack of the coroutine waiting for them */
+    if (g_file_io_threads && g_coro_shared_stack) {
+        printf("file_io_threads must be 0 with coroutine_shared_stack\n");
+        exit(0);
+    }
+}
+
+/* Parse the "ip:port" or "port" of configuration entry @key.
+ * Return 0 on success, 1 if the entry is "off".
+ */
+int get_listen_conf(const char *key, char **addr, int *port)
+{
+    char *c = get_conf_entry(key);
+    if (str_equal(c, "off"))
+        return 1;
+
+    *addr = NULL;
+    char *colon = strrchr(c, ':');
+    if (colon) {
+        *addr = strndup(c, colon - c);
+        c = colon + 1;
+    }
+
+    *port = atoi(c);
+    if (*port <= 0 || *port > 65535) {
+        printf("check %s config: %d, should be positive\n", key, *port);
+        exit(0);
+    }
+
+    return 0;
 }
 
 static void set_server_env()
 {
-    g_server_addr = NULL;
+    if (get_listen_conf("listen", &g_server_addr, &g_server_port)) {
+        printf("check listen config: off, should be [ip:]port\n");
+        exit(0);
+    }
 
-    char *head = get_conf_entry("listen");
-    for (char *loop = head; *loop; loop++) {
-        if (*loop == ':') {
-            g_server_addr = head;
-            *loop = 0;
-            head = loop + 1;
-        }
+    char *c = get_conf_entry("reuse_port");
+    if (str_equal(c, "on"))
+        g_reuse_port = 1;
+    else if (str_equal(c, "off"))
+        g_reuse_port = 0;
+    else {
+        printf("check reuse_port config: %s, should be on or off\n", c);
+        exit(0);
     }
 
-    g_server_port = atoi(head);
-    if (g_server_port <= 0) {
-        printf("check listen config: %d, should be positive\n", g_server_port);
+    c = get_conf_entry("accept_batch");
+    g_accept_batch = str_equal(c, "default") ? 16 : atoi(c);
+    if (g_accept_batch <= 0 || g_accept_batch > 1024) {
+        printf("check accept_batch config: %d, should default or [1~1024]\n",
+               g_accept_batch);
         exit(0);
     }
 }
 
+static int get_timeout_conf(const char *key, int default_value)
+{
+    char *c = get_conf_entry(key);
+    if (str_equal(c, "default"))
+        return default_value;
+
+    int timeout = atoi(c);
+    if (timeout <= 0 || timeout > 3600 * 1000) {
+        printf("check %s config: %d, should default or [1~3600000]\n", key,
+               timeout);
+        exit(0);
+    }
+
+    return timeout;
+}
+
+static void set_timeout_env()
+{
+    g_connect_timeout = get_timeout_conf("connect_timeout", 10 * 1000);
+    g_accept_timeout = get_timeout_conf("accept_timeout", 3 * 1000);
+    g_read_timeout = get_timeout_conf("read_timeout", 10 * 1000);
+    g_write_timeout = get_timeout_conf("write_timeout", 10 * 1000);
+}
+
 void print_env()
 {
     printf("Number of processor(s)    : %d\n", get_ncpu());
@@ -82,9 +212,20 @@ void print_env()
     printf("Logging level             : %s\n", g_log_strlevel);
     printf("Number of work processes  : %d\n", g_worker_processes);
     printf("Connection of each worker : %d\n", g_worker_connections);
-    printf("Coroutine stack size      : %dKiB\n", g_coro_stack_kbytes);
+    printf("Coroutine stack size      : %dKiB%s\n", g_coro_stack_kbytes,
+           g_coro_shared_stack ? " shared" : "");
+    printf("Event engine              : %s\n",
+           g_io_uring ? "io_uring" : "epoll");
+    printf("Edge-triggered events     : %s\n", g_edge_triggered ? "on" : "off");
+    printf("File I/O threads          : %d\n", g_file_io_threads);
     printf("Web server listen port    : %s:%d\n",
            g_server_addr ? g_server_addr : "localhost", g_server_port);
+    printf("Listen socket per worker  : %s\n", g_reuse_port ? "on" : "off");
+    printf("Accept batch size         : %d\n", g_accept_batch);
+    printf("Connect/accept timeout    : %dms/%dms\n", g_connect_timeout,
+           g_accept_timeout);
+    printf("Read/write timeout        : %dms/%dms\n", g_read_timeout,
+           g_write_timeout);
 }
 
 void conf_env_init()
@@ -92,4 +233,5 @@ void conf_env_init()
     set_log_env();
     set_worker_env();
     set_server_env();
+    set_timeout_env();
 }
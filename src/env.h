@@ -7,9 +7,22 @@ extern char *g_log_strlevel;
 extern int g_worker_processes;
 extern int g_worker_connections;
 extern int g_coro_stack_kbytes;
+extern int g_coro_shared_stack;
 
 extern char *g_server_addr;
 extern int g_server_port;
+extern int g_reuse_port;
+extern int g_accept_batch;
+extern int g_edge_triggered;
+extern int g_io_uring;
+extern int g_file_io_threads;
+
+extern int g_connect_timeout;
+extern int g_accept_timeout;
+extern int g_read_timeout;
+extern int g_write_timeout;
+
+int get_listen_conf(const char *key, char **addr, int *port);
 
 void print_env();
 void conf_env_init();
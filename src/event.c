@@ -1,6 +1,7 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <sys/epoll.h>
 
@@ -10,6 +11,12 @@ struct fd_event {
     int mask;
     event_proc_t proc;
     void *args;
+
+    /* edge-triggered registration */
+    bool registered;
+    int ready; /* readiness reported by epoll and not consumed yet */
+    event_proc_t rproc, wproc;
+    void *rargs, *wargs;
 };
 
 struct event_loop {
@@ -70,6 +77,97 @@ void del_fd_event(int fd, event_t what)
               (mask == EVNET_NONE) ? EPOLL_CTL_DEL : EPOLL_CTL_MOD, fd, &ev);
 }
 
+int register_fd_event(int fd)
+{
+    if (fd >= evloop.max_conn) {
+        errno = ERANGE;
+        return -1;
+    }
+
+    struct fd_event *fe = &evloop.array[fd];
+    struct epoll_event ev = {
+        .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+        .data.fd = fd,
+    };
+
+    if (-1 == epoll_ctl(evloop.epoll_fd, EPOLL_CTL_ADD, fd, &ev))
+        return -2;
+
+    fe->registered = true;
+    fe->ready = EVENT_READABLE | EVENT_WRITABLE; /* let the first call try */
+    fe->rproc = fe->wproc = NULL;
+
+    return 0;
+}
+
+/* close() removes the fd from epoll, only the local state is reset here */
+void unregister_fd_event(int fd)
+{
+    if (fd >= evloop.max_conn)
+        return;
+
+    struct fd_event *fe = &evloop.array[fd];
+    fe->registered = false;
+    fe->ready = EVNET_NONE;
+    fe->rproc = fe->wproc = NULL;
+}
+
+bool is_fd_event_registered(int fd)
+{
+    return fd < evloop.max_conn && evloop.array[fd].registered;
+}
+
+/* The caller got EAGAIN, so the readiness of @what has been consumed */
+void park_fd_event(int fd, event_t what, event_proc_t proc, void *args)
+{
+    struct fd_event *fe = &evloop.array[fd];
+
+    fe->ready &= ~what;
+    if (what & EVENT_READABLE)
+        fe->rproc = proc, fe->rargs = args;
+    if (what & EVENT_WRITABLE)
+        fe->wproc = proc, fe->wargs = args;
+}
+
+void unpark_fd_event(int fd, event_t what)
+{
+    struct fd_event *fe = &evloop.array[fd];
+
+    if (what & EVENT_READABLE)
+        fe->rproc = NULL;
+    if (what & EVENT_WRITABLE)
+        fe->wproc = NULL;
+}
+
+/* Waiters are one-shot: a waiter parked on both directions runs once */
+static void fire_fd_event(struct fd_event *fe, uint32_t events)
+{
+    event_proc_t proc;
+
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        fe->ready |= EVENT_READABLE;
+        if ((proc = fe->rproc)) {
+            if (fe->wproc == proc && fe->wargs == fe->rargs)
+                fe->wproc = NULL;
+            fe->rproc = NULL;
+            proc(fe->rargs);
+        }
+    }
+
+    if (events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+        fe->ready |= EVENT_WRITABLE;
+        if ((proc = fe->wproc)) {
+            fe->wproc = NULL;
+            proc(fe->wargs);
+        }
+    }
+}
+
+int event_loop_fd()
+{
+    return evloop.epoll_fd;
+}
+
 void event_cycle(int ms /* in milliseconds */)
 {
     int value = epoll_wait(evloop.epoll_fd, evloop.ev, evloop.max_conn, ms);
@@ -79,7 +177,10 @@ void event_cycle(int ms /* in milliseconds */)
     for (int i = 0; i < value; i++) {
         struct epoll_event *ev = &evloop.ev[i];
         struct fd_event *fe = &evloop.array[ev->data.fd];
-        fe->proc(fe->args);
+        if (fe->registered)
+            fire_fd_event(fe, ev->events);
+        else
+            fe->proc(fe->args);
     }
 }
 
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdbool.h>
+
 typedef enum {
     EVNET_NONE = 0x0,
     EVENT_READABLE = 0x1,
@@ -11,5 +13,15 @@ typedef void (*event_proc_t)(void *args);
 int add_fd_event(int fd, event_t what, event_proc_t proc, void *args);
 void del_fd_event(int fd, event_t what);
 
+/* Edge-triggered registration: the fd stays in epoll until it is closed, and
+ * waiters are attached per direction without touching epoll again.
+ */
+int register_fd_event(int fd);
+void unregister_fd_event(int fd);
+bool is_fd_event_registered(int fd);
+void park_fd_event(int fd, event_t what, event_proc_t proc, void *args);
+void unpark_fd_event(int fd, event_t what);
+
+int event_loop_fd();
 void event_cycle(int milliseconds);
 void event_loop_init(int max_conn);
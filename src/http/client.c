@@ -0,0 +1,1093 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <limits.h>
+#include <netdb.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "coro/sched.h"
+#include "coro/sync.h"
+#include "env.h"
+#include "http/client.h"
+#include "http/parse.h"
+#include "http/response.h"
+#include "logger.h"
+#include "syscall_hook.h"
+#include "thread_pool.h"
+#include "util/list.h"
+#include "util/net.h"
+#include "util/system.h"
+
+#define RESPONSE_HEADER_SIZE (8 << 10)
+#define DEFAULT_MAX_BODY (16 << 20)
+#define READ_CHUNK_SIZE (16 << 10)
+#define IDLE_CONN_TIMEOUT (30 * 1000) /* upstreams close idle ones too */
+#define NO_TICKET ULLONG_MAX
+
+static int max_conns = 32;
+static int pipeline_depth = 1;
+
+struct http_upstream {
+    struct list_head list;
+    char *host;
+    int port;
+    char *host_header;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+
+    struct list_head idle; /* most recently used first */
+    struct list_head busy;
+    int nr_conns;              /* open, or being connected */
+    int nr_active;             /* requests holding a connection */
+    struct wait_queue waiters; /* for a connection to free up */
+    struct list_head flights;  /* coalesced requests in flight */
+};
+
+/* upstreams of this worker */
+static struct list_head upstreams = LIST_HEAD_INIT(upstreams);
+
+/* A request takes a ticket as it starts writing, and reads its response once
+ * every earlier ticket is done: responses come back in the order the
+ * requests went out. When the connection breaks, the tickets from broken_at
+ * on fail without waiting, the earlier ones still get their responses.
+ */
+struct upstream_conn {
+    struct list_head list;
+    struct http_upstream *up;
+    int fd;
+    int inflight; /* requests holding the connection */
+    int unsafe;   /* of which not idempotent, nothing is pipelined behind */
+    unsigned long long sent, done, broken_at;
+    long long idle_since;
+
+    struct coro_mutex send_lock;
+    struct wait_queue turn;
+
+    struct http_request parser;
+    struct buffer in; /* may hold the start of the next response */
+    unsigned char data[RESPONSE_HEADER_SIZE];
+};
+
+/* A request that identical ones wait for instead of being sent. The leader
+ * fills in the response; once done, the flight leaves the upstream and lives
+ * on as the owner of the response buffers shared by the requests.
+ */
+struct http_flight {
+    struct list_head list;
+    int refs; /* requests waiting, and responses handed out */
+    bool done;
+    int ret;
+    struct http_client_response resp;
+    struct wait_queue waiters;
+
+    size_t max_body;
+    unsigned hash;
+    size_t key_len;
+    char key[]; /* method, URI and headers, '\0' separated */
+};
+
+struct resolve_task {
+    const char *host;
+    char port[8];
+    struct addrinfo *res;
+    int ret;
+};
+
+static void resolve(void *args)
+{
+    struct resolve_task *t = args;
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+    };
+
+    t->ret = getaddrinfo(t->host, t->port, &hints, &t->res);
+}
+
+static int resolve_upstream(struct http_upstream *up)
+{
+    struct sockaddr_in *sin = (struct sockaddr_in *) &up->addr;
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) &up->addr;
+
+    if (inet_pton(AF_INET, up->host, &sin->sin_addr) == 1) {
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(up->port);
+        up->addrlen = sizeof(struct sockaddr_in);
+        return 0;
+    }
+
+    if (inet_pton(AF_INET6, up->host, &sin6->sin6_addr) == 1) {
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(up->port);
+        up->addrlen = sizeof(struct sockaddr_in6);
+        return 0;
+    }
+
+    /* getaddrinfo() needs far more stack than a coroutine has */
+    struct resolve_task t = {.host = up->host, .res = NULL};
+    snprintf(t.port, sizeof(t.port), "%d", up->port);
+    if (thread_pool_run(resolve, &t)) {
+        ERR("upstream %s is not an address, resolving it needs "
+            "file_io_threads",
+            up->host);
+        return -1;
+    }
+
+    if (t.ret) {
+        ERR("failed to resolve upstream %s: %s", up->host,
+            gai_strerror(t.ret));
+        return -1;
+    }
+
+    memcpy(&up->addr, t.res->ai_addr, t.res->ai_addrlen);
+    up->addrlen = t.res->ai_addrlen;
+    freeaddrinfo(t.res);
+
+    return 0;
+}
+
+static struct http_upstream *find_upstream(const char *host, int port)
+{
+    struct http_upstream *up;
+
+    list_for_each_entry(up, &upstreams, list) {
+        if (up->port == port && str_equal(up->host, host))
+            return up;
+    }
+
+    return NULL;
+}
+
+static void free_upstream(struct http_upstream *up)
+{
+    free(up->host);
+    free(up->host_header);
+    free(up);
+}
+
+struct http_upstream *http_upstream_get(const char *host, int port)
+{
+    struct http_upstream *up = find_upstream(host, port);
+    if (up)
+        return up;
+
+    up = calloc(1, sizeof(struct http_upstream));
+    if (!up)
+        return NULL;
+
+    up->port = port;
+    up->host = strdup(host);
+    up->host_header = malloc(strlen(host) + sizeof("[]:65535"));
+    if (!up->host || !up->host_header) {
+        free_upstream(up);
+        return NULL;
+    }
+
+    const char *fmt = strchr(host, ':') ? "[%s]" : "%s";
+    int len = sprintf(up->host_header, fmt, host);
+    if (port != 80)
+        sprintf(up->host_header + len, ":%d", port);
+
+    if (resolve_upstream(up)) {
+        free_upstream(up);
+        return NULL;
+    }
+
+    /* another coroutine may have got there while we were resolving */
+    struct http_upstream *found = find_upstream(host, port);
+    if (found) {
+        free_upstream(up);
+        return found;
+    }
+
+    INIT_LIST_HEAD(&up->idle);
+    INIT_LIST_HEAD(&up->busy);
+    wait_queue_init(&up->waiters);
+    INIT_LIST_HEAD(&up->flights);
+    list_add_tail(&up->list, &upstreams);
+
+    return up;
+}
+
+static int conn_open(struct http_upstream *up, struct upstream_conn **conn)
+{
+    struct upstream_conn *c = malloc(sizeof(struct upstream_conn));
+    if (!c)
+        return -4;
+
+    c->fd = socket(up->addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (c->fd < 0) {
+        free(c);
+        return -1;
+    }
+
+    /* the slot is taken while connecting */
+    up->nr_conns++;
+
+    int ret = connect(c->fd, (struct sockaddr *) &up->addr, up->addrlen);
+    if (ret) {
+        close(c->fd);
+        free(c);
+        up->nr_conns--;
+        wait_queue_wake(&up->waiters);
+        return ret == -3 ? -3 : -1;
+    }
+
+    enable_tcp_no_delay(c->fd);
+
+    c->up = up;
+    c->inflight = c->unsafe = 0;
+    c->sent = c->done = 0;
+    c->broken_at = NO_TICKET;
+    coro_mutex_init(&c->send_lock);
+    wait_queue_init(&c->turn);
+    bind_buffer(&c->in, c->data, sizeof(c->data));
+    list_add(&c->list, &up->busy);
+
+    *conn = c;
+    return 0;
+}
+
+static void conn_close(struct upstream_conn *c)
+{
+    struct http_upstream *up = c->up;
+
+    list_del(&c->list);
+    close(c->fd);
+    free(c);
+
+    up->nr_conns--;
+    wait_queue_wake(&up->waiters);
+}
+
+/* Whether an idle connection can take a request: not kept too long, not
+ * closed by the upstream, and with nothing unexpected to read.
+ */
+static bool conn_usable(struct upstream_conn *c)
+{
+    char ch;
+
+    if (get_curr_mseconds() - c->idle_since > IDLE_CONN_TIMEOUT ||
+        c->in.pos != c->in.last)
+        return false;
+
+    return real_sys_recv(c->fd, &ch, 1, MSG_PEEK | MSG_DONTWAIT) < 0 &&
+           (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/* the busy connection with the fewest requests queued behind */
+static struct upstream_conn *conn_to_pipeline(struct http_upstream *up)
+{
+    struct upstream_conn *c, *best = NULL;
+
+    list_for_each_entry(c, &up->busy, list) {
+        if (c->broken_at != NO_TICKET || c->unsafe ||
+            c->inflight >= pipeline_depth)
+            continue;
+        if (!best || c->inflight < best->inflight)
+            best = c;
+    }
+
+    return best;
+}
+
+/* Get a connection for one request: an idle one, a new one while under the
+ * limit, a busy one to pipeline on, or else wait for one of those. With
+ * @fresh, only a new connection will do.
+ */
+static int conn_acquire(struct http_upstream *up,
+                        bool safe,
+                        bool fresh,
+                        struct upstream_conn **conn)
+{
+    struct upstream_conn *c;
+    int ret;
+
+    for (;;) {
+        while (!fresh && !list_empty(&up->idle)) {
+            c = list_first_entry(&up->idle, struct upstream_conn, list);
+            if (conn_usable(c)) {
+                list_del(&c->list);
+                list_add(&c->list, &up->busy);
+                goto found;
+            }
+            conn_close(c);
+        }
+
+        if (up->nr_conns < max_conns) {
+            if ((ret = conn_open(up, &c)))
+                return ret;
+            goto found;
+        }
+
+        /* make room for a new connection, the least recently used goes */
+        if (fresh && !list_empty(&up->idle)) {
+            conn_close(list_entry(up->idle.prev, struct upstream_conn, list));
+            continue;
+        }
+
+        if (safe && !fresh && (c = conn_to_pipeline(up)))
+            goto found;
+
+        int timeout = coro_timeout(g_connect_timeout);
+        if (timeout < 0 || wait_queue_sleep(&up->waiters, timeout)) {
+            errno = ETIME;
+            return -3;
+        }
+    }
+
+found:
+    up->nr_active++;
+    c->inflight++;
+    if (!safe)
+        c->unsafe++;
+
+    *conn = c;
+    return 0;
+}
+
+static void conn_release(struct upstream_conn *c, bool safe)
+{
+    struct http_upstream *up = c->up;
+
+    up->nr_active--;
+    c->inflight--;
+    if (!safe)
+        c->unsafe--;
+
+    if (!c->inflight) {
+        if (c->broken_at != NO_TICKET) {
+            conn_close(c);
+            return;
+        }
+
+        c->idle_since = get_curr_mseconds();
+        list_del(&c->list);
+        list_add(&c->list, &up->idle);
+    }
+
+    wait_queue_wake(&up->waiters);
+}
+
+/* no request from @ticket on gets a response over @c */
+static void conn_break(struct upstream_conn *c, unsigned long long ticket)
+{
+    if (ticket < c->broken_at)
+        c->broken_at = ticket;
+
+    wait_queue_wake_all(&c->turn);
+}
+
+static int send_request(struct upstream_conn *c,
+                        struct iovec *iov,
+                        int cnt,
+                        unsigned long long *ticket)
+{
+    if (coro_mutex_lock(&c->send_lock, -1))
+        return -3;
+
+    *ticket = c->sent++;
+    if (*ticket >= c->broken_at) {
+        coro_mutex_unlock(&c->send_lock);
+        return -1;
+    }
+
+    int ret = http_send_iovecs(c->fd, iov, cnt);
+
+    coro_mutex_unlock(&c->send_lock);
+    return ret;
+}
+
+/* wait until the responses before @ticket have been read */
+static int wait_turn(struct upstream_conn *c, unsigned long long ticket)
+{
+    while (c->done != ticket && ticket < c->broken_at) {
+        int timeout = coro_timeout(INT_MAX);
+        if (timeout < 0 ||
+            wait_queue_sleep(&c->turn, timeout == INT_MAX ? -1 : timeout)) {
+            errno = ETIME;
+            return -3;
+        }
+    }
+
+    return ticket < c->broken_at ? 0 : -1;
+}
+
+static int recv_error(ssize_t n)
+{
+    if (n == 0) {
+        errno = ECONNRESET;
+        return -1;
+    }
+
+    return (n == -3) ? -3 : -1;
+}
+
+int http_response_recv(int fd, struct buffer *b, bool *received)
+{
+    if (b->last == b->end)
+        return -2;
+
+    ssize_t n = recv(fd, b->last, b->end - b->last, 0);
+    if (n <= 0)
+        return recv_error(n);
+
+    b->last += n;
+    *received = true;
+    return 0;
+}
+
+static inline bool header_is(const struct http_request *r, const char *name)
+{
+    size_t len = strlen(name);
+
+    return r->header_name.len == len && !memcmp(r->lowcase_header, name, len);
+}
+
+static int add_header(struct http_client_response *resp,
+                      const struct http_request *r)
+{
+    /* the array doubles from 16 on */
+    int n = resp->nr_headers;
+    if (!n || (n >= 16 && !(n & (n - 1)))) {
+        void *p = realloc(resp->headers,
+                          (n ? 2 * n : 16) * sizeof(*resp->headers));
+        if (!p)
+            return -4;
+        resp->headers = p;
+    }
+
+    struct http_client_header *h = &resp->headers[resp->nr_headers++];
+    h->name = r->header_name;
+    h->value = r->header_value;
+
+    return 0;
+}
+
+int http_read_response_head(int fd,
+                            struct http_request *r,
+                            struct buffer *b,
+                            struct http_response_head *head,
+                            struct http_client_response *resp,
+                            bool *received)
+{
+    bool close, keep, coded;
+    int ret;
+
+    for (;;) {
+        head->start = b->pos;
+        while ((ret = http_parse_status_line(r, b, &head->status)) == 1) {
+            if ((ret = http_response_recv(fd, b, received)))
+                return ret;
+        }
+        if (ret < 0)
+            return -2;
+
+        if (resp)
+            resp->nr_headers = 0;
+        head->length = -1;
+        head->chunked = close = keep = coded = false;
+
+        for (;;) {
+            ret = http_parse_request_header(r, b);
+            if (ret == 1) {
+                if ((ret = http_response_recv(fd, b, received)))
+                    return ret;
+                continue;
+            }
+            if (ret < 0)
+                return -2;
+            if (ret == 100)
+                break;
+            if (r->invalid_header)
+                continue;
+
+            if (resp && add_header(resp, r))
+                return -4;
+
+            str_t *v = &r->header_value;
+            if (header_is(r, "content-length")) {
+                if (!v->len)
+                    return -2;
+                head->length = 0;
+                for (size_t i = 0; i < v->len; i++) {
+                    if (v->p[i] < '0' || v->p[i] > '9' ||
+                        head->length > (LLONG_MAX - 9) / 10)
+                        return -2;
+                    head->length = head->length * 10 + v->p[i] - '0';
+                }
+            } else if (header_is(r, "transfer-encoding")) {
+                /* a later header adds codings after those before */
+                head->chunked = http_last_token_is(*v, "chunked");
+                coded = true;
+            } else if (header_is(r, "connection")) {
+                close |= http_has_token(*v, "close");
+                keep |= http_has_token(*v, "keep-alive");
+            }
+        }
+
+        /* interim responses come before the final one */
+        if (head->status >= 200)
+            break;
+        if (head->status == 101)
+            return -2;
+    }
+
+    head->http_version = r->http_version;
+    head->keepalive = !close && (r->http_version >= HTTP_VER_11 || keep);
+    /* codings not ending with chunked leave only the connection to end it,
+     * and a length sent along with chunked makes the response suspect
+     */
+    if (head->chunked && head->length >= 0)
+        head->keepalive = false;
+    if (coded)
+        head->length = -1;
+
+    return 0;
+}
+
+static int read_header(struct upstream_conn *c,
+                       struct http_client_response *resp,
+                       struct http_response_head *head,
+                       bool *received)
+{
+    struct buffer *b = &c->in;
+
+    /* the whole header is to fit in the buffer */
+    size_t left = b->last - b->pos;
+    memmove(b->start, b->pos, left);
+    b->pos = b->start;
+    b->last = b->start + left;
+
+    int ret =
+        http_read_response_head(c->fd, &c->parser, b, head, resp, received);
+    if (ret)
+        return ret;
+
+    resp->status = head->status;
+    resp->http_version = head->http_version;
+
+    /* detach the header from the buffer */
+    unsigned char *start = head->start;
+    size_t size = b->pos - start;
+    resp->header_data = malloc(size);
+    if (!resp->header_data)
+        return -4;
+
+    memcpy(resp->header_data, start, size);
+    for (int i = 0; i < resp->nr_headers; i++) {
+        struct http_client_header *h = &resp->headers[i];
+        h->name.p = resp->header_data + (h->name.p - start);
+        if (h->value.p)
+            h->value.p = resp->header_data + (h->value.p - start);
+    }
+
+    return 0;
+}
+
+/* make room for @n more bytes of body */
+static int body_reserve(struct http_client_response *resp,
+                        size_t *cap,
+                        size_t n,
+                        size_t max_body)
+{
+    if (n <= *cap - resp->body_len)
+        return 0;
+
+    if (n > max_body - resp->body_len)
+        return -4;
+
+    size_t size = *cap ? *cap : READ_CHUNK_SIZE;
+    while (size - resp->body_len < n)
+        size <<= 1;
+    if (size > max_body)
+        size = max_body;
+
+    unsigned char *p = realloc(resp->body, size);
+    if (!p)
+        return -4;
+
+    resp->body = p;
+    *cap = size;
+    return 0;
+}
+
+/* Read the body in the buffer first, then straight from the socket, never
+ * past the end of the body: the next response may follow.
+ */
+static int read_body(struct upstream_conn *c,
+                     struct http_client_response *resp,
+                     struct http_response_head *head,
+                     size_t max_body)
+{
+    struct http_request *r = &c->parser;
+    struct buffer *b = &c->in;
+    bool to_close = !head->chunked && head->length < 0;
+    size_t cap = 0;
+    int ret;
+
+    if (head->chunked) {
+        r->body_state = B_chunk_size;
+        r->body_rest = -1;
+    } else {
+        r->body_state = head->length ? B_data : B_done;
+        r->body_rest = to_close ? LLONG_MAX : head->length;
+        head->keepalive &= !to_close;
+    }
+
+    while (r->body_state != B_done) {
+        if (r->body_state == B_data) {
+            size_t n = r->body_rest;
+            if (to_close) {
+                /* too large only if data comes past max_body */
+                n = max_body - resp->body_len;
+                if (n > READ_CHUNK_SIZE)
+                    n = READ_CHUNK_SIZE;
+                if (!n) {
+                    unsigned char more;
+                    ssize_t got = (b->pos < b->last) ? 1
+                                                     : recv(c->fd, &more, 1, 0);
+                    if (!got)
+                        break;
+                    return got < 0 ? recv_error(got) : -4;
+                }
+            }
+            if ((ret = body_reserve(resp, &cap, n, max_body)))
+                return ret;
+
+            unsigned char *dst = resp->body + resp->body_len;
+            size_t buffered = b->last - b->pos;
+            if (buffered) {
+                if (n > buffered)
+                    n = buffered;
+                memcpy(dst, b->pos, n);
+                b->pos += n;
+            } else {
+                ssize_t got = recv(c->fd, dst, n, 0);
+                if (got == 0 && to_close)
+                    break;
+                if (got <= 0)
+                    return recv_error(got);
+                n = got;
+            }
+
+            resp->body_len += n;
+            r->body_rest -= n;
+            if (!r->body_rest)
+                r->body_state = head->chunked ? B_chunk_data_cr : B_done;
+            continue;
+        }
+
+        if (b->pos == b->last) {
+            b->pos = b->last = b->start;
+            bool received;
+            if ((ret = http_response_recv(c->fd, b, &received)))
+                return ret;
+        }
+
+        ret = http_parse_chunked(r, b->pos, b->last);
+        if (ret < 0)
+            return -2;
+        b->pos += ret;
+    }
+
+    return 0;
+}
+
+static int read_response(struct upstream_conn *c,
+                         bool head,
+                         size_t max_body,
+                         struct http_client_response *resp,
+                         bool *keepalive,
+                         bool *received)
+{
+    struct http_response_head framing;
+    int ret = read_header(c, resp, &framing, received);
+    if (ret)
+        return ret;
+
+    if (head || resp->status == 204 || resp->status == 304) {
+        framing.chunked = false;
+        framing.length = 0;
+    }
+
+    ret = read_body(c, resp, &framing, max_body);
+    *keepalive = framing.keepalive;
+
+    return ret;
+}
+
+/* One attempt over one connection. Set @retry if the request can safely be
+ * sent again: the connection was reused and failed before any of the
+ * response came.
+ */
+static int exchange(struct http_upstream *up,
+                    const struct http_client_request *req,
+                    bool safe,
+                    bool head,
+                    bool fresh,
+                    struct iovec *iov,
+                    int cnt,
+                    struct http_client_response *resp,
+                    bool *retry)
+{
+    unsigned long long ticket = NO_TICKET;
+    struct upstream_conn *c;
+    bool keepalive = false, received = false;
+
+    int ret = conn_acquire(up, safe, fresh, &c);
+    if (ret)
+        return ret;
+
+    ret = send_request(c, iov, cnt, &ticket);
+    if (!ret)
+        ret = wait_turn(c, ticket);
+    if (!ret) {
+        size_t max_body = req->max_body ? req->max_body : DEFAULT_MAX_BODY;
+        ret = read_response(c, head, max_body, resp, &keepalive, &received);
+    }
+
+    if (ret) {
+        http_client_response_free(resp);
+        *retry = safe && ret == -1 && !received && ticket != NO_TICKET &&
+                 ticket > 0;
+        if (ticket != NO_TICKET)
+            conn_break(c, ticket);
+    } else {
+        c->done++;
+        if (keepalive)
+            wait_queue_wake_all(&c->turn);
+        else
+            conn_break(c, ticket + 1);
+    }
+
+    conn_release(c, safe);
+    return ret;
+}
+
+static bool is_idempotent(const char *method)
+{
+    static const char *methods[] = {"GET",    "HEAD",    "PUT",
+                                    "DELETE", "OPTIONS", "TRACE"};
+
+    for (size_t i = 0; i < sizeof(methods) / sizeof(methods[0]); i++) {
+        if (str_equal(method, methods[i]))
+            return true;
+    }
+
+    return false;
+}
+
+static inline char *append(char *p, const char *s)
+{
+    size_t len = strlen(s);
+
+    memcpy(p, s, len);
+    return p + len;
+}
+
+/* formatted by hand, printf() takes more stack than a coroutine can spare */
+static char *build_request_head(struct http_upstream *up,
+                                const struct http_client_request *req,
+                                const char *method,
+                                size_t *len)
+{
+    const char *headers = req->headers ? req->headers : "";
+    bool with_length = req->body_len || str_equal(method, "POST") ||
+                       str_equal(method, "PUT") || str_equal(method, "PATCH");
+
+    size_t size = strlen(method) + strlen(req->uri) +
+                  strlen(up->host_header) + strlen(headers) + 64;
+    char *head = malloc(size);
+    if (!head)
+        return NULL;
+
+    char *p = append(head, method);
+    p = append(p, " ");
+    p = append(p, req->uri);
+    p = append(p, " HTTP/1.1" CRLF "Host: ");
+    p = append(p, up->host_header);
+    p = append(p, CRLF);
+
+    if (with_length) {
+        p = append(p, "Content-Length: ");
+        p = append_size(p, req->body_len);
+        p = append(p, CRLF);
+    }
+
+    p = append(p, headers);
+    p = append(p, CRLF);
+
+    *len = p - head;
+    return head;
+}
+
+static int fetch(struct http_upstream *up,
+                 const struct http_client_request *req,
+                 const char *method,
+                 struct http_client_response *resp)
+{
+    bool safe = is_idempotent(method);
+    bool head = str_equal(method, "HEAD");
+    size_t head_len;
+    int ret;
+
+    char *request_head = build_request_head(up, req, method, &head_len);
+    if (!request_head)
+        return -4;
+
+    for (int attempt = 0;; attempt++) {
+        struct iovec iov[2] = {
+            {.iov_base = request_head, .iov_len = head_len},
+            {.iov_base = (void *) req->body, .iov_len = req->body_len},
+        };
+        bool retry = false;
+
+        ret = exchange(up, req, safe, head, attempt > 0, iov,
+                       req->body_len ? 2 : 1, resp, &retry);
+        if (!ret || !retry || attempt)
+            break;
+    }
+
+    free(request_head);
+    return ret;
+}
+
+static void flight_put(struct http_flight *f)
+{
+    if (--f->refs)
+        return;
+
+    http_client_response_free(&f->resp);
+    free(f);
+}
+
+/* The flight of @up keyed by @key, NULL if none. Fills in @key, which holds
+ * the method, URI and headers of @req.
+ */
+static struct http_flight *flight_find(struct http_upstream *up,
+                                       const struct http_client_request *req,
+                                       const char *method,
+                                       str_t *key,
+                                       unsigned *hash)
+{
+    const char *parts[] = {method, req->uri, req->headers ? req->headers : ""};
+    char *p = (char *) key->p;
+    unsigned h = 2166136261u; /* FNV-1a */
+
+    for (size_t i = 0; i < ARRAY_SIZE(parts); i++) {
+        size_t len = strlen(parts[i]) + 1;
+
+        memcpy(p, parts[i], len);
+        p += len;
+    }
+    key->len = p - (char *) key->p;
+
+    for (size_t i = 0; i < key->len; i++)
+        h = (h ^ key->p[i]) * 16777619u;
+    *hash = h;
+
+    struct http_flight *f;
+    list_for_each_entry (f, &up->flights, list) {
+        if (f->hash == h && f->key_len == key->len &&
+            f->max_body == req->max_body && !memcmp(f->key, key->p, key->len))
+            return f;
+    }
+
+    return NULL;
+}
+
+/* Wait for the leader of @f, and take its response. Return 1 if the leader
+ * timed out while the current coroutine still has time, to try again.
+ */
+static int flight_join(struct http_flight *f, struct http_client_response *resp)
+{
+    int ret = 0;
+
+    f->refs++;
+    while (!f->done) {
+        int timeout = coro_timeout(INT_MAX);
+        if (timeout < 0 ||
+            wait_queue_sleep(&f->waiters, timeout == INT_MAX ? -1 : timeout)) {
+            errno = ETIME;
+            ret = -3;
+            break;
+        }
+    }
+
+    if (!ret) {
+        if (!(ret = f->ret)) {
+            *resp = f->resp;
+            resp->flight = f;
+            return 0;
+        }
+
+        /* the deadline of the leader, or its cancellation, is not ours */
+        if (ret == -3 && coro_timeout(INT_MAX) > 0)
+            ret = 1;
+    }
+
+    flight_put(f);
+    return ret;
+}
+
+static int fetch_coalesced(struct http_upstream *up,
+                           const struct http_client_request *req,
+                           const char *method,
+                           struct http_client_response *resp)
+{
+    size_t size = strlen(method) + strlen(req->uri) +
+                  (req->headers ? strlen(req->headers) : 0) + 3;
+    struct http_flight *f, *found;
+    str_t key;
+    int ret;
+
+    do {
+        f = malloc(sizeof(struct http_flight) + size);
+        if (!f)
+            return fetch(up, req, method, resp);
+
+        key.p = (unsigned char *) f->key;
+        found = flight_find(up, req, method, &key, &f->hash);
+        if (!found)
+            break;
+
+        free(f);
+    } while ((ret = flight_join(found, resp)) == 1);
+
+    if (found)
+        return ret;
+
+    f->refs = 1;
+    f->done = false;
+    f->key_len = key.len;
+    f->max_body = req->max_body;
+    memset(&f->resp, 0, sizeof(f->resp));
+    wait_queue_init(&f->waiters);
+    list_add_tail(&f->list, &up->flights);
+
+    f->ret = fetch(up, req, method, &f->resp);
+    f->done = true;
+    list_del(&f->list);
+    wait_queue_wake_all(&f->waiters);
+
+    if (f->ret) {
+        ret = f->ret;
+        flight_put(f);
+        return ret;
+    }
+
+    *resp = f->resp;
+    resp->flight = f;
+    return 0;
+}
+
+int http_client_request(struct http_upstream *up,
+                        const struct http_client_request *req,
+                        struct http_client_response *resp)
+{
+    const char *method = req->method ? req->method : "GET";
+    long long deadline = get_coro_deadline();
+    int ret;
+
+    memset(resp, 0, sizeof(*resp));
+
+    if (req->timeout > 0) {
+        int timeout = coro_timeout(req->timeout);
+        if (timeout <= 0) {
+            errno = ETIME;
+            return -3;
+        }
+        set_coro_deadline(timeout);
+    }
+
+    if (req->coalesce && !req->body_len &&
+        (str_equal(method, "GET") || str_equal(method, "HEAD")))
+        ret = fetch_coalesced(up, req, method, resp);
+    else
+        ret = fetch(up, req, method, resp);
+
+    restore_coro_deadline(deadline);
+    return ret;
+}
+
+struct upstream_conn *http_upstream_borrow(struct http_upstream *up,
+                                           bool fresh,
+                                           int *err)
+{
+    struct upstream_conn *c;
+
+    /* not idempotent as far as the pool knows: nothing queues behind */
+    if ((*err = conn_acquire(up, false, fresh, &c)))
+        return NULL;
+
+    c->sent++;
+    return c;
+}
+
+int http_upstream_conn_fd(struct upstream_conn *c)
+{
+    return c->fd;
+}
+
+bool http_upstream_conn_reused(struct upstream_conn *c)
+{
+    return c->sent > 1;
+}
+
+void http_upstream_release(struct upstream_conn *c, bool keepalive)
+{
+    if (keepalive)
+        c->done++;
+    else
+        conn_break(c, c->sent - 1);
+
+    conn_release(c, false);
+}
+
+int http_upstream_active(struct http_upstream *up)
+{
+    return up->nr_active;
+}
+
+const char *http_upstream_host(struct http_upstream *up)
+{
+    return up->host_header;
+}
+
+void http_client_response_free(struct http_client_response *resp)
+{
+    if (resp->flight) {
+        flight_put(resp->flight);
+    } else {
+        free(resp->headers);
+        free(resp->header_data);
+        free(resp->body);
+    }
+    memset(resp, 0, sizeof(*resp));
+}
+
+const str_t *http_client_header(const struct http_client_response *resp,
+                                const char *name)
+{
+    size_t len = strlen(name);
+
+    for (int i = 0; i < resp->nr_headers; i++) {
+        const struct http_client_header *h = &resp->headers[i];
+        if (h->name.len == len && !strncasecmp((char *) h->name.p, name, len))
+            return &h->value;
+    }
+
+    return NULL;
+}
+
+void http_client_init(int conns, int depth)
+{
+    max_conns = conns;
+    pipeline_depth = depth;
+}
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "util/str.h"
+
+/* Outbound HTTP/1.1 requests from a coroutine, e.g. a handler querying a
+ * backend. Each worker keeps its own pool of keep-alive connections per
+ * upstream; a request takes an idle connection, opens a new one while under
+ * upstream_connections, or else queues behind the requests already sent on a
+ * busy one when pipelining is allowed.
+ *
+ * Responses are read whole, within the deadline of the request.
+ */
+struct http_upstream;
+
+/* The upstream for @host:@port, created on first use and kept for the life
+ * of the worker. Host names other than literal addresses are resolved on the
+ * file I/O thread pool, and need it. Return NULL on failure.
+ */
+struct http_upstream *http_upstream_get(const char *host, int port);
+
+struct http_client_request {
+    const char *method; /* "GET" if NULL */
+    const char *uri;
+    const char *headers; /* extra "Name: value\r\n" lines, or NULL */
+    const void *body;
+    size_t body_len;
+    int timeout;     /* ms for the whole exchange, 0 for none */
+    size_t max_body; /* largest response body accepted, 0 for 16 MiB */
+    bool coalesce;   /* share the response with identical requests */
+};
+
+struct http_client_header {
+    str_t name, value;
+};
+
+struct http_client_response {
+    int status;
+    int http_version;
+    struct http_client_header *headers;
+    int nr_headers;
+    unsigned char *body;
+    size_t body_len;
+
+    unsigned char *header_data; /* backs the headers */
+    struct http_flight *flight; /* owns the buffers when coalesced */
+};
+
+/* Send @req to @u and read the response into @resp, which is to be freed
+ * with http_client_response_free() on success. Return 0 on success, -1 if
+ * the upstream could not be reached or dropped the connection, -2 on a
+ * malformed response, -3 on timeout (errno ETIME), -4 if the response is too
+ * large or memory ran out.
+ *
+ * Requests with an idempotent method are retried once on a fresh connection
+ * when a reused one turns out to be closed before any of the response came.
+ *
+ * With @req->coalesce, a GET or HEAD without a body joins an identical one
+ * of this worker already in flight, i.e. one with the same method, upstream,
+ * URI, headers and max_body, instead of going out again: the waiters wake up
+ * when it completes, and all share its outcome and the buffers of its
+ * response, which are then read-only. A waiter still leaves on its own
+ * timeout, and when the one it waited for timed out with time left to the
+ * waiter, the waiter sends the request itself, or joins another doing so.
+ */
+int http_client_request(struct http_upstream *u,
+                        const struct http_client_request *req,
+                        struct http_client_response *resp);
+void http_client_response_free(struct http_client_response *resp);
+
+/* A connection of @u lent out whole, for the caller to write a request and
+ * read its response itself, e.g. to stream them through. With @fresh, a new
+ * connection is opened. Return NULL on failure, with *@err as
+ * http_client_request() would return.
+ */
+struct upstream_conn;
+struct upstream_conn *http_upstream_borrow(struct http_upstream *u,
+                                           bool fresh,
+                                           int *err);
+int http_upstream_conn_fd(struct upstream_conn *c);
+
+/* Whether @c carried earlier requests, and so may have been closed by the
+ * upstream meanwhile.
+ */
+bool http_upstream_conn_reused(struct upstream_conn *c);
+
+/* Give @c back, to be kept for later requests if @keepalive: the response
+ * was read whole and the upstream keeps the connection open.
+ */
+void http_upstream_release(struct upstream_conn *c, bool keepalive);
+
+/* requests of this worker holding a connection to @u */
+int http_upstream_active(struct http_upstream *u);
+
+/* Host header naming @u, as host[:port] */
+const char *http_upstream_host(struct http_upstream *u);
+
+struct http_request;
+struct buffer;
+
+/* Framing of a response, as its header tells */
+struct http_response_head {
+    int status;
+    int http_version;
+    long long length; /* -1 without Content-Length, or chunked */
+    bool chunked;
+    bool keepalive;       /* the connection can carry the next response */
+    unsigned char *start; /* status line of the final response */
+};
+
+/* Read the status line and header of a response on @fd into @b, e.g. on a
+ * borrowed connection, past interim responses to the final one, and collect
+ * the headers into @resp unless NULL. The header stays in @b, followed by
+ * whatever of the body came with it. Return 0, or as http_client_request().
+ * @received is set once any byte came.
+ */
+int http_read_response_head(int fd,
+                            struct http_request *parser,
+                            struct buffer *b,
+                            struct http_response_head *head,
+                            struct http_client_response *resp,
+                            bool *received);
+
+/* Read more of a response into @b, e.g. chunk framing. Return 0, -1 if the
+ * connection failed or was closed, -2 if @b is full, -3 on timeout.
+ */
+int http_response_recv(int fd, struct buffer *b, bool *received);
+
+/* value of header @name of @resp, NULL if absent */
+const str_t *http_client_header(const struct http_client_response *resp,
+                                const char *name);
+
+void http_client_init(int max_conns, int pipeline_depth);
@@ -1,6 +1,9 @@
 #include <stdlib.h>
 
+#include "http/client.h"
+#include "http/proxy.h"
 #include "http/request.h"
+#include "http/static.h"
 #include "logger.h"
 #include "process.h"
 #include "util/conf.h"
@@ -17,11 +20,111 @@ static int worker_process_init()
         }
     }
 
-    http_request_init(size, NULL, NULL, NULL);
+    http_request_body_handler_t body_handler = NULL;
+    c = get_conf_entry("document_root");
+    if (!str_equal(c, "off")) {
+        int cache_size = 1024;
+        char *cache = get_conf_entry("open_file_cache");
+        if (!str_equal(cache, "default")) {
+            cache_size = atoi(cache);
+            if (cache_size < 0) {
+                ERR("open file cache size should not be negative");
+                return -1;
+            }
+        }
+
+        if (http_static_init(c, cache_size))
+            return -1;
+        body_handler = http_static_handler;
+    }
+
+    c = get_conf_entry("proxy_pass");
+    if (!str_equal(c, "off")) {
+        if (body_handler) {
+            ERR("document_root and proxy_pass can not both be on");
+            return -1;
+        }
+
+        if (http_proxy_init(c, get_conf_entry("proxy_balance")))
+            return -1;
+        body_handler = http_proxy_handler;
+    }
+
+    http_request_init(size, NULL, NULL, body_handler);
+
+    int header_timeout = 10 * 1000;
+    c = get_conf_entry("client_header_timeout");
+    if (!str_equal(c, "default")) {
+        header_timeout = atoi(c);
+        if (header_timeout < 0 || header_timeout > 3600 * 1000) {
+            ERR("client header timeout should between [0-3600000] "
+                "milliseconds");
+            return -1;
+        }
+    }
+
+    http_header_timeout_init(header_timeout);
+
+    int timeout = 15;
+    c = get_conf_entry("keepalive_timeout");
+    if (!str_equal(c, "default")) {
+        timeout = atoi(c);
+        if (timeout < 0 || timeout > 3600) {
+            ERR("keepalive timeout should between [0-3600] seconds");
+            return -1;
+        }
+    }
+
+    int requests = 1000;
+    c = get_conf_entry("keepalive_requests");
+    if (!str_equal(c, "default")) {
+        requests = atoi(c);
+        if (requests <= 0) {
+            ERR("keepalive requests should be positive");
+            return -1;
+        }
+    }
+
+    http_keepalive_init(timeout, requests);
+
+    long long max_body = 16;
+    c = get_conf_entry("client_max_body_mbytes");
+    if (!str_equal(c, "default")) {
+        max_body = atoll(c);
+        if (max_body <= 0 || max_body > (1 << 20)) {
+            ERR("client max body size should between [1-1048576]MiB");
+            return -1;
+        }
+    }
+
+    http_body_init(max_body << 20);
+
+    int conns = 32;
+    c = get_conf_entry("upstream_connections");
+    if (!str_equal(c, "default")) {
+        conns = atoi(c);
+        if (conns <= 0 || conns > 4096) {
+            ERR("upstream connections should between [1-4096]");
+            return -1;
+        }
+    }
+
+    int depth = 1;
+    c = get_conf_entry("upstream_pipeline_depth");
+    if (!str_equal(c, "default")) {
+        depth = atoi(c);
+        if (depth <= 0 || depth > 64) {
+            ERR("upstream pipeline depth should between [1-64]");
+            return -1;
+        }
+    }
+
+    http_client_init(conns, depth);
     return 0;
 }
 
 __INIT static void http_init()
 {
-    register_service(NULL, worker_process_init, http_request_handler);
+    register_service("listen", NULL, worker_process_init,
+                     http_request_handler);
 }
@@ -1,6 +1,13 @@
+#include <limits.h>
 #include <stdio.h>
+#include <strings.h>
 
-#include "http/request.h"
+#if defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_SIMD_SCAN
+#endif
+
+#include "http/parse.h"
 #include "logger.h"
 #include "util/hashtable.h"
 
@@ -44,6 +51,193 @@ static unsigned usual[] = {
     0xffffffff  /* 1111 1111 1111 1111  1111 1111 1111 1111 */
 };
 
+#define IS_USUAL(ch) (usual[(ch) >> 5] & (1U << ((ch) &0x1f)))
+
+/* Runs of plain URI, header name and header value bytes are skipped 16 or 32
+ * bytes at a time when the CPU allows. The vector scanners only look at whole
+ * blocks before @end and return the first byte ending the run, or where they
+ * stopped; the scalar loops finish the tail.
+ */
+enum { SIMD_NONE = 0, SIMD_SSE42, SIMD_AVX2 };
+static int simd_level = SIMD_NONE;
+
+#ifdef HAVE_SIMD_SCAN
+/* every byte IS_USUAL() rejects, also loaded in scan_uri_sse42() */
+#define URI_SPECIALS "\0\r\n #%+./?"
+#define URI_NSPECIALS (sizeof(URI_SPECIALS) - 1)
+
+__attribute__((target("sse4.2"))) static unsigned char *
+scan_uri_sse42(unsigned char *p, unsigned char *end)
+{
+    const __m128i set = _mm_setr_epi8('\0', CR, LF, ' ', '#', '%', '+', '.',
+                                      '/', '?', 0, 0, 0, 0, 0, 0);
+
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) p);
+        int i = _mm_cmpestri(set, URI_NSPECIALS, v, 16,
+                             _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY |
+                                 _SIDD_LEAST_SIGNIFICANT);
+        if (i != 16)
+            return p + i;
+    }
+
+    return p;
+}
+
+__attribute__((target("sse4.2"))) static unsigned char *
+scan_name_sse42(unsigned char *p, unsigned char *end)
+{
+    const __m128i ranges = _mm_setr_epi8('0', '9', 'A', 'Z', 'a', 'z', '-',
+                                         '-', 0, 0, 0, 0, 0, 0, 0, 0);
+
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) p);
+        int i = _mm_cmpestri(ranges, 8, v, 16,
+                             _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES |
+                                 _SIDD_NEGATIVE_POLARITY |
+                                 _SIDD_LEAST_SIGNIFICANT);
+        if (i != 16)
+            return p + i;
+    }
+
+    return p;
+}
+
+__attribute__((target("sse4.2"))) static unsigned char *
+scan_value_sse42(unsigned char *p, unsigned char *end)
+{
+    const __m128i set = _mm_setr_epi8('\0', CR, LF, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                      0, 0, 0, 0);
+
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) p);
+        int i = _mm_cmpestri(set, 3, v, 16,
+                             _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY |
+                                 _SIDD_LEAST_SIGNIFICANT);
+        if (i != 16)
+            return p + i;
+    }
+
+    return p;
+}
+
+__attribute__((target("avx2"))) static unsigned char *
+scan_uri_avx2(unsigned char *p, unsigned char *end)
+{
+    for (; end - p >= 32; p += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) p);
+        __m256i hit = _mm256_setzero_si256();
+
+        for (size_t k = 0; k < URI_NSPECIALS; k++)
+            hit = _mm256_or_si256(
+                hit, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(URI_SPECIALS[k])));
+
+        unsigned mask = _mm256_movemask_epi8(hit);
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+
+    return p;
+}
+
+/* bytes 0x80 and above are negative, so the signed ranges leave them out */
+__attribute__((target("avx2"))) static unsigned char *
+scan_name_avx2(unsigned char *p, unsigned char *end)
+{
+    for (; end - p >= 32; p += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) p);
+        __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+
+        __m256i alpha =
+            _mm256_and_si256(_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)),
+                             _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), lower));
+        __m256i digit =
+            _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('0' - 1)),
+                             _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), v));
+        __m256i dash = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('-'));
+
+        unsigned mask = ~_mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_or_si256(alpha, digit), dash));
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+
+    return p;
+}
+
+__attribute__((target("avx2"))) static unsigned char *
+scan_value_avx2(unsigned char *p, unsigned char *end)
+{
+    for (; end - p >= 32; p += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) p);
+        __m256i hit = _mm256_or_si256(
+            _mm256_cmpeq_epi8(v, _mm256_setzero_si256()),
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(CR)),
+                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8(LF))));
+
+        unsigned mask = _mm256_movemask_epi8(hit);
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+
+    return p;
+}
+
+static __INIT void parse_simd_init(void)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        simd_level = SIMD_AVX2;
+    else if (__builtin_cpu_supports("sse4.2"))
+        simd_level = SIMD_SSE42;
+}
+
+#define SIMD_SCAN(name, p, end)                   \
+    do {                                          \
+        if (simd_level == SIMD_AVX2)              \
+            p = scan_##name##_avx2(p, end);       \
+        else if (simd_level == SIMD_SSE42)        \
+            p = scan_##name##_sse42(p, end);      \
+    } while (0)
+#else
+#define SIMD_SCAN(name, p, end) \
+    do {                        \
+    } while (0)
+#endif
+
+/* Return the first byte in [p, end) that IS_USUAL() rejects, or end */
+static inline unsigned char *scan_uri(unsigned char *p, unsigned char *end)
+{
+    SIMD_SCAN(uri, p, end);
+    while (p < end && IS_USUAL(*p))
+        p++;
+
+    return p;
+}
+
+/* Return the first byte in [p, end) that is not [0-9A-Za-z-], or end */
+static inline unsigned char *scan_name(unsigned char *p, unsigned char *end)
+{
+    SIMD_SCAN(name, p, end);
+    for (; p < end; p++) {
+        unsigned char c = *p | 0x20;
+        if (!((c >= 'a' && c <= 'z') || (*p >= '0' && *p <= '9') || *p == '-'))
+            break;
+    }
+
+    return p;
+}
+
+/* Return the first CR, LF or NUL in [p, end), or end */
+static inline unsigned char *scan_value(unsigned char *p, unsigned char *end)
+{
+    SIMD_SCAN(value, p, end);
+    while (p < end && *p != CR && *p != LF && *p != '\0')
+        p++;
+
+    return p;
+}
+
 enum http_request_line_status {
     S_start = 0,
     S_method,
@@ -319,7 +513,7 @@ int http_parse_request_line(struct http_request *r, struct buffer *b)
             break;
             /* check the character following by "/" */
         case S_after_slash_in_uri:
-            if (usual[ch >> 5] & (1 << (ch & 0x1f))) {
+            if (IS_USUAL(ch)) {
                 state = S_check_uri;
                 break;
             }
@@ -370,8 +564,10 @@ int http_parse_request_line(struct http_request *r, struct buffer *b)
             break;
         /* check "/", "%" and "\" (Win32) in URI */
         case S_check_uri:
-            if (usual[ch >> 5] & (1 << (ch & 0x1f)))
+            if (IS_USUAL(ch)) {
+                p = scan_uri(p + 1, b->last) - 1;
                 break;
+            }
             switch (ch) {
             case '/':
                 str_init(&r->exten);
@@ -439,8 +635,10 @@ int http_parse_request_line(struct http_request *r, struct buffer *b)
             break;
         /* URI */
         case S_uri: /* the character following (%?#/). regard as uri */
-            if (usual[ch >> 5] & (1 << (ch & 0x1f)))
+            if (IS_USUAL(ch)) {
+                p = scan_uri(p + 1, b->last) - 1;
                 break;
+            }
             switch (ch) {
             case ' ':
                 r->uri.len = p - r->uri.p;
@@ -615,6 +813,45 @@ done:
     return 0;
 }
 
+/* Status line of a response, "HTTP/1.1 200 OK". The header that follows is
+ * parsed by http_parse_request_header() like the one of a request.
+ * Return 0 if complete, 1 if the line has not been received in full, < 0 on
+ * error.
+ */
+int http_parse_status_line(struct http_request *r,
+                           struct buffer *b,
+                           int *status)
+{
+    unsigned char *p = b->pos;
+    unsigned char *lf = memchr(p, LF, b->last - p);
+
+    if (!lf)
+        return 1;
+
+    if (lf - p < 12 || memcmp(p, "HTTP/", 5) || p[6] != '.' || p[8] != ' ')
+        return -1;
+
+    if (p[5] < '0' || p[5] > '9' || p[7] < '0' || p[7] > '9')
+        return -2;
+    r->http_major = p[5] - '0';
+    r->http_minor = p[7] - '0';
+    r->http_version = r->http_major * 1000 + r->http_minor;
+
+    *status = 0;
+    for (p += 9; p < b->pos + 12; p++) {
+        if (*p < '0' || *p > '9')
+            return -3;
+        *status = *status * 10 + *p - '0';
+    }
+    if (*p != ' ' && *p != CR && *p != LF)
+        return -4;
+
+    b->pos = lf + 1;
+    r->state = 0; /* the header starts */
+
+    return 0;
+}
+
 /* Return 0 on complete; 1: continue; 100: done with one line; < 0 on error */
 int http_parse_request_header(struct http_request *r, struct buffer *b)
 {
@@ -679,9 +916,16 @@ int http_parse_request_header(struct http_request *r, struct buffer *b)
         case S_name:
             c = lowcase[ch]; /* Only handle 0-9, -, A-Z, a-z */
             if (c) {
-                hash = HASH(hash, c);
-                r->lowcase_header[i++] = c;
-                i &= (HTTP_LC_HEADER_LEN - 1);
+                unsigned char *name_end = scan_name(p + 1, b->last);
+                for (;;) {
+                    hash = HASH(hash, c);
+                    r->lowcase_header[i++] = c;
+                    i &= (HTTP_LC_HEADER_LEN - 1);
+                    if (++p == name_end)
+                        break;
+                    c = lowcase[*p];
+                }
+                p--;
                 break;
             }
             if (ch == ':') {
@@ -726,11 +970,22 @@ int http_parse_request_header(struct http_request *r, struct buffer *b)
             break;
         /* header value */
         case S_value:
-            switch (ch) {
-            case ' ':
-                r->header_value.len = p - r->header_value.p;
-                state = S_space_after_value;
+            if (ch != CR && ch != LF && ch != '\0') {
+                /* skip to the end of line, then step back over trailing
+                 * spaces as S_space_after_value would have
+                 */
+                unsigned char *eol = scan_value(p + 1, b->last);
+                unsigned char *end = eol;
+                while (end[-1] == ' ')
+                    end--;
+                if (end != eol) {
+                    r->header_value.len = end - r->header_value.p;
+                    state = S_space_after_value;
+                }
+                p = eol - 1;
                 break;
+            }
+            switch (ch) {
             case CR:
                 r->header_value.len = p - r->header_value.p;
                 state = S_almost_done;
@@ -798,3 +1053,161 @@ header_done:
     r->state = S_start;
     return 100; /* all requests are completed */
 }
+
+/* chunk extensions and the trailer are skipped, but not without end */
+#define MAX_CHUNK_EXTRA 2048 /* as the default header buffer */
+
+/* Walk the chunked framing in [start, end) up to the next chunk data or the
+ * end of the body. Return the number of bytes consumed, -1 if malformed or
+ * an extension or the trailer is longer than MAX_CHUNK_EXTRA.
+ */
+int http_parse_chunked(struct http_request *r,
+                       unsigned char *start,
+                       unsigned char *end)
+{
+    unsigned char *p = start;
+
+    for (; p < end; p++) {
+        unsigned char ch = *p;
+        int digit;
+
+        switch (r->body_state) {
+        case B_chunk_size: /* body_rest is -1 until the first digit */
+            digit = hex_value(ch);
+            if (digit >= 0) {
+                if (r->body_rest < 0)
+                    r->body_rest = 0;
+                if (r->body_rest > (LLONG_MAX >> 4))
+                    return -1;
+                r->body_rest = (r->body_rest << 4) + digit;
+                break;
+            }
+            if (r->body_rest < 0)
+                return -1;
+            if (ch == ';' || ch == ' ' || ch == '\t') {
+                r->body_state = B_chunk_ext;
+                r->chunk_extra = 0;
+            } else if (ch == CR)
+                r->body_state = B_chunk_size_lf;
+            else if (ch == LF)
+                goto size_done;
+            else
+                return -1;
+            break;
+        case B_chunk_ext:
+            if (++r->chunk_extra > MAX_CHUNK_EXTRA)
+                return -1;
+            if (ch == CR)
+                r->body_state = B_chunk_size_lf;
+            else if (ch == LF)
+                goto size_done;
+            break;
+        case B_chunk_size_lf:
+            if (ch != LF)
+                return -1;
+            goto size_done;
+        case B_chunk_data_cr:
+            if (ch == CR) {
+                r->body_state = B_chunk_data_lf;
+                break;
+            }
+            fallthrough;
+        case B_chunk_data_lf:
+            if (ch != LF)
+                return -1;
+            r->body_rest = -1;
+            r->body_state = B_chunk_size;
+            break;
+        case B_trailer:
+            if (++r->chunk_extra > MAX_CHUNK_EXTRA)
+                return -1;
+            if (ch == CR)
+                r->body_state = B_trailer_lf;
+            else if (ch == LF)
+                goto body_done;
+            else
+                r->body_state = B_trailer_line;
+            break;
+        case B_trailer_line:
+            if (++r->chunk_extra > MAX_CHUNK_EXTRA)
+                return -1;
+            if (ch == LF)
+                r->body_state = B_trailer;
+            break;
+        case B_trailer_lf:
+            if (ch != LF)
+                return -1;
+            goto body_done;
+        default:
+            return p - start;
+        }
+        continue;
+
+    size_done:
+        if (!r->body_rest) {
+            r->body_state = B_trailer;
+            r->chunk_extra = 0;
+            continue;
+        }
+        r->body_state = B_data;
+        return p + 1 - start;
+    }
+
+    return p - start;
+
+body_done:
+    r->body_state = B_done;
+    return p + 1 - start;
+}
+
+/* Take the next element of the comma separated list in @v, without the
+ * whitespace around it. Return false at the end of the list.
+ */
+static bool next_token(str_t *v, str_t *token)
+{
+    unsigned char *p = v->p, *end = v->p + v->len;
+
+    while (p < end && (*p == ',' || *p == ' ' || *p == '\t'))
+        p++;
+    if (p == end)
+        return false;
+
+    token->p = p;
+    while (p < end && *p != ',')
+        p++;
+    token->len = p - token->p;
+    while (token->p[token->len - 1] == ' ' || token->p[token->len - 1] == '\t')
+        token->len--;
+
+    v->p = p;
+    v->len = end - p;
+    return true;
+}
+
+static inline bool token_is(const str_t *token, const char *s)
+{
+    return token->len == strlen(s) &&
+           !strncasecmp((const char *) token->p, s, token->len);
+}
+
+bool http_has_token(str_t v, const char *token)
+{
+    str_t t;
+
+    while (next_token(&v, &t)) {
+        if (token_is(&t, token))
+            return true;
+    }
+
+    return false;
+}
+
+bool http_last_token_is(str_t v, const char *token)
+{
+    str_t t = NULL_STRING;
+
+    while (next_token(&v, &t))
+        ;
+
+    return t.p && token_is(&t, token);
+}
@@ -1,6 +1,35 @@
 #pragma once
 
+#include <stdbool.h>
+
 #include "http/request.h"
 
+/* body_state, B_done is also the state of a message without body */
+enum {
+    B_done = 0,
+    B_data, /* body_rest bytes of data follow */
+    B_chunk_size,
+    B_chunk_ext,
+    B_chunk_size_lf,
+    B_chunk_data_cr,
+    B_chunk_data_lf,
+    B_trailer,
+    B_trailer_line,
+    B_trailer_lf,
+};
+
 int http_parse_request_line(struct http_request *request, struct buffer *b);
 int http_parse_request_header(struct http_request *request, struct buffer *b);
+int http_parse_status_line(struct http_request *r,
+                           struct buffer *b,
+                           int *status);
+int http_parse_chunked(struct http_request *r,
+                       unsigned char *start,
+                       unsigned char *end);
+
+/* Whether the comma separated header value @v, e.g. of Connection, has
+ * @token as an element, or ends with it, as chunked ends Transfer-Encoding.
+ * Elements are matched without regard to case.
+ */
+bool http_has_token(str_t v, const char *token);
+bool http_last_token_is(str_t v, const char *token);
@@ -0,0 +1,819 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "http/client.h"
+#include "http/parse.h"
+#include "http/proxy.h"
+#include "http/response.h"
+#include "logger.h"
+#include "util/net.h"
+#include "util/str.h"
+
+#define MAX_BACKENDS 32
+#define RING_POINTS 160 /* points of each backend on the hash ring */
+#define PROXY_BUFFER_SIZE (8 << 10)
+#define RELAY_CHUNK_SIZE (64 << 10) /* the default pipe capacity */
+#define MAX_FREE_PIPES 64
+
+enum { BALANCE_ROUND_ROBIN, BALANCE_LEAST_CONN, BALANCE_URI_HASH };
+
+/* Status of an attempt that can go on with another connection */
+#define PROXY_NEXT_BACKEND -1 /* the backend could not be reached */
+#define PROXY_RETRY -2        /* a kept connection was closed under us */
+
+struct backend {
+    char *host;
+    int port;
+    struct http_upstream *up; /* looked up on first use */
+};
+
+static struct backend backends[MAX_BACKENDS];
+static int nr_backends;
+static int balance = BALANCE_ROUND_ROBIN;
+static unsigned next_backend;
+
+struct ring_point {
+    unsigned hash;
+    int backend;
+};
+
+static struct ring_point *ring;
+static int nr_points;
+
+/* empty pipes kept for later relays */
+static int free_pipes[MAX_FREE_PIPES][2];
+static int nr_free_pipes;
+
+struct proxy_request {
+    struct http_request *r;
+    struct backend *backend; /* the one the request head names */
+    int pipefd[2];
+    bool pipe_dirty; /* bytes may be left in the pipe */
+
+    /* request body: spooled, or taken over from the client connection */
+    int body_fd;
+    long long body_len; /* -1 without body */
+    str_t body_buffered;
+    long long body_rest; /* still to be received from the client */
+    bool body_started;   /* some of it was received, it cannot be replayed */
+    bool timed_out;
+
+    unsigned char *header_end; /* of the request, before any body */
+    size_t head_len;
+    struct http_request parser; /* of the response */
+    struct buffer in;
+    unsigned char data[PROXY_BUFFER_SIZE];
+    unsigned char out[PROXY_BUFFER_SIZE]; /* request, then response head */
+};
+
+static inline unsigned fnv1a(unsigned hash, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ p[i]) * 16777619;
+
+    return hash;
+}
+
+#define FNV1A_INIT 2166136261u
+
+static int ring_point_cmp(const void *a, const void *b)
+{
+    unsigned x = ((const struct ring_point *) a)->hash;
+    unsigned y = ((const struct ring_point *) b)->hash;
+
+    return (x > y) - (x < y);
+}
+
+static int build_ring()
+{
+    ring = malloc(nr_backends * RING_POINTS * sizeof(struct ring_point));
+    if (!ring)
+        return -1;
+
+    for (int i = 0; i < nr_backends; i++) {
+        for (int k = 0; k < RING_POINTS; k++) {
+            unsigned hash = fnv1a(FNV1A_INIT, backends[i].host,
+                                  strlen(backends[i].host));
+            hash = fnv1a(hash, &backends[i].port, sizeof(int));
+            hash = fnv1a(hash, &k, sizeof(int));
+
+            ring[nr_points].hash = hash;
+            ring[nr_points++].backend = i;
+        }
+    }
+
+    qsort(ring, nr_points, sizeof(struct ring_point), ring_point_cmp);
+    return 0;
+}
+
+/* the backend owning the first point of the ring at or after the path hash */
+static int hash_backend(struct http_request *r)
+{
+    unsigned char *q = memchr(r->uri.p, '?', r->uri.len);
+    size_t len = q ? (size_t) (q - r->uri.p) : r->uri.len;
+    unsigned hash = fnv1a(FNV1A_INIT, r->uri.p, len);
+
+    int lo = 0, hi = nr_points;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (ring[mid].hash < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return ring[lo == nr_points ? 0 : lo].backend;
+}
+
+/* Fewest requests in flight from this worker, ties go round robin */
+static int least_conn_backend()
+{
+    int best = -1, best_active = 0;
+
+    for (int n = 0; n < nr_backends; n++) {
+        int i = (next_backend + n) % nr_backends;
+        int active = backends[i].up ? http_upstream_active(backends[i].up) : 0;
+        if (best < 0 || active < best_active) {
+            best = i;
+            best_active = active;
+        }
+    }
+
+    next_backend++;
+    return best;
+}
+
+static int pick_backend(struct http_request *r)
+{
+    switch (balance) {
+    case BALANCE_LEAST_CONN:
+        return least_conn_backend();
+    case BALANCE_URI_HASH:
+        return hash_backend(r);
+    default:
+        return next_backend++ % nr_backends;
+    }
+}
+
+static int get_pipe(struct proxy_request *p)
+{
+    if (nr_free_pipes) {
+        nr_free_pipes--;
+        p->pipefd[0] = free_pipes[nr_free_pipes][0];
+        p->pipefd[1] = free_pipes[nr_free_pipes][1];
+        return 0;
+    }
+
+    if (pipe2(p->pipefd, O_NONBLOCK | O_CLOEXEC)) {
+        ERR("Failed to create relay pipe: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static void put_pipe(struct proxy_request *p)
+{
+    if (p->pipefd[0] < 0)
+        return;
+
+    if (p->pipe_dirty || nr_free_pipes == MAX_FREE_PIPES) {
+        close(p->pipefd[0]);
+        close(p->pipefd[1]);
+    } else {
+        free_pipes[nr_free_pipes][0] = p->pipefd[0];
+        free_pipes[nr_free_pipes][1] = p->pipefd[1];
+        nr_free_pipes++;
+    }
+
+    p->pipefd[0] = p->pipefd[1] = -1;
+}
+
+/* Move @len bytes, or all of them up to EOF if @len is negative, from socket
+ * @in to socket @out through the pipe. Return 0, -1 if @in failed or ended
+ * early, -2 if @out failed.
+ */
+static int relay(struct proxy_request *p, int in, int out, long long len)
+{
+    if (!len)
+        return 0;
+
+    if (p->pipefd[0] < 0 && get_pipe(p))
+        return -2;
+
+    while (len) {
+        size_t size = (len < 0 || len > RELAY_CHUNK_SIZE) ? RELAY_CHUNK_SIZE
+                                                          : (size_t) len;
+        ssize_t n = splice(in, NULL, p->pipefd[1], NULL, size,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n == 0 && len < 0)
+            return 0;
+        if (n <= 0)
+            return -1;
+
+        if (len > 0)
+            len -= n;
+
+        p->pipe_dirty = true;
+        while (n) {
+            ssize_t m = splice(p->pipefd[0], NULL, out, NULL, n,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (m <= 0)
+                return -2;
+            n -= m;
+        }
+        p->pipe_dirty = false;
+    }
+
+    return 0;
+}
+
+static inline int send_all(int fd, const void *data, size_t len)
+{
+    struct iovec iov = {.iov_base = (void *) data, .iov_len = len};
+
+    return http_send_iovecs(fd, &iov, 1);
+}
+
+static inline bool name_is(const unsigned char *name,
+                           size_t len,
+                           const char *s)
+{
+    return len == strlen(s) && !strncasecmp((const char *) name, s, len);
+}
+
+/* Headers about one connection, or about the framing of the body, are not
+ * passed on: the proxy sets its own.
+ */
+static bool hop_by_hop(const unsigned char *name, size_t len)
+{
+    static const char *names[] = {
+        "connection",        "keep-alive", "proxy-connection",
+        "transfer-encoding", "te",         "trailer",
+        "upgrade",           "content-length", "expect",
+    };
+
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (name_is(name, len, names[i]))
+            return true;
+    }
+
+    return false;
+}
+
+static inline unsigned char *append(unsigned char *p, const void *s, size_t n)
+{
+    memcpy(p, s, n);
+    return p + n;
+}
+
+#define APPEND(p, literal) append(p, literal, sizeof(literal) - 1)
+
+static inline unsigned char *append_number(unsigned char *p, long long value)
+{
+    return (unsigned char *) append_size((char *) p, value);
+}
+
+/* Request line and header for upstream @up, from the header lines the client
+ * sent. Return -1 if they do not fit.
+ */
+static int build_request_head(struct proxy_request *p, struct http_upstream *up)
+{
+    struct http_request *r = p->r;
+    unsigned char *line = r->request_line.p + r->request_line.len;
+    unsigned char *end = p->header_end;
+    unsigned char *o = p->out, *o_end = p->out + sizeof(p->out);
+    str_t forwarded_for = NULL_STRING;
+    char *ip = get_peer_ip(r->fd);
+    const char *host = http_upstream_host(up);
+
+    line = memchr(line, LF, end - line);
+    line = line ? line + 1 : end;
+
+    size_t len = r->method_name.len + r->uri.len + strlen(ip) +
+                 strlen(host) + 160;
+    if ((size_t) (end - line) + len > sizeof(p->out))
+        return -1;
+
+    o = append(o, r->method_name.p, r->method_name.len);
+    o = APPEND(o, " ");
+    o = append(o, r->uri.p, r->uri.len);
+    o = APPEND(o, " HTTP/1.1" CRLF);
+
+    while (line < end) {
+        unsigned char *lf = memchr(line, LF, end - line);
+        unsigned char *next = lf ? lf + 1 : end;
+        unsigned char *colon = memchr(line, ':', next - line);
+
+        if (colon) {
+            size_t name_len = colon - line;
+            if (name_is(line, name_len, "x-forwarded-for")) {
+                unsigned char *v = colon + 1, *v_end = lf ? lf : end;
+                while (v < v_end && *v == ' ')
+                    v++;
+                while (v_end > v && (v_end[-1] == CR || v_end[-1] == ' '))
+                    v_end--;
+                forwarded_for.p = v;
+                forwarded_for.len = v_end - v;
+            } else if (!hop_by_hop(line, name_len)) {
+                o = append(o, line, next - line);
+            }
+        }
+        line = next;
+    }
+
+    /* HTTP/1.0 clients may leave it out, HTTP/1.1 requires it */
+    if (!http_header_exist(&r->headers_in.host)) {
+        o = APPEND(o, "Host: ");
+        o = append(o, host, strlen(host));
+        o = APPEND(o, CRLF);
+    }
+
+    o = APPEND(o, "X-Forwarded-For: ");
+    if (forwarded_for.len) {
+        o = append(o, forwarded_for.p, forwarded_for.len);
+        o = APPEND(o, ", ");
+    }
+    o = append(o, ip, strlen(ip));
+    o = APPEND(o, CRLF);
+
+    if (p->body_len >= 0) {
+        o = APPEND(o, "Content-Length: ");
+        o = append_number(o, p->body_len);
+        o = APPEND(o, CRLF);
+    }
+    o = APPEND(o, CRLF);
+
+    if (o > o_end) /* cannot happen, room was checked */
+        return -1;
+
+    p->head_len = o - p->out;
+    return 0;
+}
+
+/* Get the request body ready to be sent: Content-Length bodies are taken
+ * over to be spliced, chunked ones are spooled and sent with their length.
+ * Return 0 or the status code to answer with.
+ */
+static int prepare_body(struct proxy_request *p)
+{
+    struct http_request *r = p->r;
+
+    p->body_fd = -1;
+    p->body_len = -1;
+    p->body_rest = 0;
+    str_init(&p->body_buffered);
+
+    if (r->chunked) {
+        int fd = http_spool_body(r);
+        if (fd < 0)
+            return fd == -2 ? HTTP_REQUEST_ENTITY_TOO_LARGE : HTTP_BAD_REQUEST;
+
+        p->body_fd = fd;
+        p->body_len = r->body_received;
+        return 0;
+    }
+
+    if (r->content_len >= 0 || r->method & (HTTP_POST | HTTP_PUT | HTTP_PATCH))
+        p->body_len = r->content_len > 0 ? r->content_len : 0;
+
+    p->body_rest = http_take_body(r, &p->body_buffered);
+    return 0;
+}
+
+static int send_request(struct proxy_request *p, int fd)
+{
+    struct iovec iov[2] = {
+        {.iov_base = p->out, .iov_len = p->head_len},
+        {.iov_base = p->body_buffered.p, .iov_len = p->body_buffered.len},
+    };
+
+    if (http_send_iovecs(fd, iov, p->body_buffered.len ? 2 : 1))
+        return -1;
+
+    if (p->body_fd >= 0) {
+        off_t offset = 0;
+        while (offset < p->body_len) {
+            if (sendfile(fd, p->body_fd, &offset, p->body_len - offset) <= 0)
+                return -2;
+        }
+    } else if (p->body_rest) {
+        p->body_started = true;
+        if (relay(p, p->r->fd, fd, p->body_rest))
+            return -2;
+    }
+
+    return 0;
+}
+
+static bool replayable(struct proxy_request *p)
+{
+    return !p->body_started &&
+           (p->r->method & (HTTP_GET | HTTP_HEAD | HTTP_PUT | HTTP_DELETE |
+                            HTTP_OPTIONS | HTTP_TRACE));
+}
+
+struct response_info {
+    struct http_response_head head;
+    str_t status_line; /* after the HTTP version */
+    bool unframed;     /* ends with the connection */
+    bool no_body;      /* whatever the header says */
+};
+
+/* Read the status line and header of the response. Return 0, -1 if the
+ * connection failed, -2 on a malformed or oversized header, -3 on timeout.
+ */
+static int read_response_head(struct proxy_request *p,
+                              int fd,
+                              struct response_info *info,
+                              bool *received)
+{
+    struct http_response_head *head = &info->head;
+    struct buffer *b = &p->in;
+
+    bind_buffer(b, p->data, sizeof(p->data));
+    int ret = http_read_response_head(fd, &p->parser, b, head, NULL, received);
+    if (ret)
+        return ret;
+
+    str_t *line = &info->status_line;
+    line->p = head->start + 9;
+    line->len = (unsigned char *) memchr(line->p, LF, b->pos - line->p) -
+                line->p;
+    while (line->len && line->p[line->len - 1] == CR)
+        line->len--;
+
+    info->no_body = (p->r->method & HTTP_HEAD) ||
+                    head->status == HTTP_NO_CONTENT ||
+                    head->status == HTTP_NOT_MODIFIED;
+    info->unframed = !info->no_body && !head->chunked && head->length < 0;
+
+    return 0;
+}
+
+/* Response head for the client, with its own framing and Connection */
+static int build_response_head(struct proxy_request *p,
+                               struct response_info *info,
+                               bool with_length,
+                               bool chunked)
+{
+    struct http_request *r = p->r;
+    unsigned char *o = p->out;
+    unsigned char *end = p->in.pos;
+
+    /* the header of the final response ends what was parsed */
+    unsigned char *line = info->status_line.p + info->status_line.len;
+    line = memchr(line, LF, end - line) + 1;
+
+    if ((size_t) (end - line) + info->status_line.len + 128 > sizeof(p->out))
+        return -1;
+
+    o = APPEND(o, "HTTP/1.1 ");
+    o = append(o, info->status_line.p, info->status_line.len);
+    o = APPEND(o, CRLF);
+
+    while (line < end) {
+        unsigned char *lf = memchr(line, LF, end - line);
+        unsigned char *next = lf ? lf + 1 : end;
+        unsigned char *colon = memchr(line, ':', next - line);
+
+        /* a chunked body passed on keeps the codings before chunked */
+        if (colon && (!hop_by_hop(line, colon - line) ||
+                      (chunked &&
+                       name_is(line, colon - line, "transfer-encoding"))))
+            o = append(o, line, next - line);
+        line = next;
+    }
+
+    if (with_length) {
+        o = APPEND(o, "Content-Length: ");
+        o = append_number(o, info->head.length);
+        o = APPEND(o, CRLF);
+    }
+
+    if (r->keep_alive)
+        o = APPEND(o, "Connection: keep-alive" CRLF CRLF);
+    else
+        o = APPEND(o, "Connection: close" CRLF CRLF);
+
+    p->head_len = o - p->out;
+    return 0;
+}
+
+/* Pass a chunked body on as it is, or only its data for HTTP/1.0 clients.
+ * The framing is read through the buffer, the data is spliced.
+ */
+static int relay_chunked(struct proxy_request *p, int fd, bool dechunk)
+{
+    struct http_request *u = &p->parser;
+    struct buffer *b = &p->in;
+    int client = p->r->fd;
+    bool received;
+
+    u->body_state = B_chunk_size;
+    u->body_rest = -1;
+
+    while (u->body_state != B_done) {
+        if (u->body_state == B_data) {
+            size_t n = b->last - b->pos;
+            if ((long long) n > u->body_rest)
+                n = u->body_rest;
+
+            if (n) {
+                if (send_all(client, b->pos, n))
+                    return -2;
+                b->pos += n;
+            } else if (relay(p, fd, client, u->body_rest)) {
+                return -1;
+            } else {
+                n = u->body_rest;
+            }
+
+            u->body_rest -= n;
+            if (!u->body_rest)
+                u->body_state = B_chunk_data_cr;
+            continue;
+        }
+
+        if (b->pos == b->last) {
+            b->pos = b->last = b->start;
+            if (http_response_recv(fd, b, &received))
+                return -1;
+        }
+
+        int n = http_parse_chunked(u, b->pos, b->last);
+        if (n < 0)
+            return -1;
+        if (!dechunk && n && send_all(client, b->pos, n))
+            return -2;
+        b->pos += n;
+    }
+
+    return 0;
+}
+
+/* Send the response on to the client. Return 0 if the upstream connection
+ * can be kept, -1 if not, -2 if the client connection failed too.
+ */
+static int relay_response(struct proxy_request *p,
+                          int fd,
+                          struct response_info *info)
+{
+    struct http_request *r = p->r;
+    struct buffer *b = &p->in;
+    struct http_response_head *head = &info->head;
+    bool dechunk = head->chunked && r->http_version < HTTP_VER_11;
+    int ret = 0;
+
+    if (dechunk || info->unframed)
+        r->keep_alive = 0;
+
+    if (build_response_head(p, info, head->length >= 0,
+                            head->chunked && !dechunk)) {
+        ERR("response header of upstream too large");
+        return -1;
+    }
+
+    /* the start of the body may have come with the header */
+    size_t buffered = 0;
+    if (!head->chunked && !info->no_body) {
+        buffered = b->last - b->pos;
+        if (head->length >= 0 && (long long) buffered > head->length)
+            buffered = head->length;
+    }
+
+    struct iovec iov[2] = {
+        {.iov_base = p->out, .iov_len = p->head_len},
+        {.iov_base = b->pos, .iov_len = buffered},
+    };
+    if (http_send_iovecs(r->fd, iov, buffered ? 2 : 1)) {
+        r->keep_alive = 0;
+        return -2;
+    }
+    b->pos += buffered;
+
+    if (info->no_body)
+        ;
+    else if (head->chunked)
+        ret = relay_chunked(p, fd, dechunk);
+    else if (info->unframed)
+        ret = relay(p, fd, r->fd, -1);
+    else
+        ret = relay(p, fd, r->fd, head->length - buffered);
+
+    if (ret) {
+        r->keep_alive = 0;
+        return ret;
+    }
+
+    /* bytes past the response would be garbage */
+    return head->keepalive && !info->unframed && b->pos == b->last ? 0 : -1;
+}
+
+static struct http_upstream *backend_upstream(struct backend *be)
+{
+    if (!be->up)
+        be->up = http_upstream_get(be->host, be->port);
+
+    return be->up;
+}
+
+/* One attempt over one upstream connection. Return 0 once a response went to
+ * the client, a status code to answer with, or PROXY_NEXT_BACKEND or
+ * PROXY_RETRY to go on with another connection.
+ */
+static int proxy_attempt(struct proxy_request *p,
+                         struct backend *be,
+                         bool fresh)
+{
+    struct http_request *r = p->r;
+    struct response_info info;
+    bool received = false;
+    int err;
+
+    struct http_upstream *up = backend_upstream(be);
+    if (!up)
+        return PROXY_NEXT_BACKEND;
+
+    /* the default Host names the backend the request goes to */
+    if (p->backend != be) {
+        if (build_request_head(p, up)) {
+            ERR("request header too large to be proxied");
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+        p->backend = be;
+    }
+
+    struct upstream_conn *c = http_upstream_borrow(up, fresh, &err);
+    if (!c) {
+        WARN("Failed to connect to upstream %s:%d: %d", be->host, be->port,
+             err);
+        p->timed_out = (err == -3);
+        return PROXY_NEXT_BACKEND;
+    }
+
+    int fd = http_upstream_conn_fd(c);
+    bool reused = http_upstream_conn_reused(c);
+
+    int ret = send_request(p, fd);
+    if (!ret)
+        ret = read_response_head(p, fd, &info, &received);
+    if (ret) {
+        http_upstream_release(c, false);
+
+        if (reused && !received && replayable(p))
+            return PROXY_RETRY;
+
+        if (p->body_started)
+            r->keep_alive = 0;
+        ERR("upstream %s:%d failed: %d errno:%d", be->host, be->port, ret,
+            errno);
+        return (ret == -3 || errno == ETIME) ? HTTP_GATEWAY_TIME_OUT
+                                              : HTTP_BAD_GATEWAY;
+    }
+
+    ret = relay_response(p, fd, &info);
+    http_upstream_release(c, ret == 0);
+
+    return 0;
+}
+
+static int proxy_pass(struct proxy_request *p)
+{
+    int ret = prepare_body(p);
+    if (ret)
+        return ret;
+
+    int idx = pick_backend(p->r);
+    p->backend = NULL;
+
+    bool fresh = false;
+    for (int tried = 0; tried < nr_backends;) {
+        ret = proxy_attempt(p, &backends[idx], fresh);
+        if (ret >= 0)
+            return ret;
+
+        if (ret == PROXY_RETRY && !fresh) {
+            fresh = true;
+            continue;
+        }
+
+        /* another backend only while the body can be sent again */
+        if (!replayable(p) && p->body_started)
+            break;
+
+        fresh = false;
+        idx = (idx + 1) % nr_backends;
+        tried++;
+    }
+
+    if (p->body_started)
+        p->r->keep_alive = 0;
+
+    return p->timed_out ? HTTP_GATEWAY_TIME_OUT : HTTP_BAD_GATEWAY;
+}
+
+void http_proxy_handler(struct http_request *r)
+{
+    if (r->http_version < HTTP_VER_10) {
+        http_finalize_request(r, HTTP_BAD_REQUEST);
+        return;
+    }
+
+    struct proxy_request *p = malloc(sizeof(struct proxy_request));
+    if (!p) {
+        ERR("no mem to proxy request");
+        r->keep_alive = 0;
+        http_finalize_request(r, HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    p->r = r;
+    p->header_end = r->header.pos;
+    p->pipefd[0] = p->pipefd[1] = -1;
+    p->pipe_dirty = false;
+    p->body_started = false;
+    p->timed_out = false;
+
+    int status = proxy_pass(p);
+    if (status)
+        http_finalize_request(r, status);
+
+    put_pipe(p);
+    free(p);
+}
+
+static int parse_backends(const char *conf)
+{
+    const char *c = conf;
+
+    while (*c) {
+        const char *end = strchr(c, ',');
+        if (!end)
+            end = c + strlen(c);
+
+        const char *colon = memrchr(c, ':', end - c);
+        if (!colon || colon == c || nr_backends == MAX_BACKENDS) {
+            ERR("check proxy_pass config: %s, should be host:port,...", conf);
+            return -1;
+        }
+
+        int port = atoi(colon + 1);
+        if (port <= 0 || port > 65535) {
+            ERR("check proxy_pass config: %s, bad port", conf);
+            return -1;
+        }
+
+        struct backend *be = &backends[nr_backends++];
+        /* IPv6 addresses come in brackets */
+        if (*c == '[' && colon[-1] == ']')
+            be->host = strndup(c + 1, colon - c - 2);
+        else
+            be->host = strndup(c, colon - c);
+        be->port = port;
+        be->up = NULL;
+        if (!be->host)
+            return -1;
+
+        c = *end ? end + 1 : end;
+    }
+
+    return nr_backends ? 0 : -1;
+}
+
+int http_proxy_init(const char *conf, const char *balance_conf)
+{
+    if (str_equal(balance_conf, "default") ||
+        str_equal(balance_conf, "round_robin"))
+        balance = BALANCE_ROUND_ROBIN;
+    else if (str_equal(balance_conf, "least_conn"))
+        balance = BALANCE_LEAST_CONN;
+    else if (str_equal(balance_conf, "uri_hash"))
+        balance = BALANCE_URI_HASH;
+    else {
+        ERR("check proxy_balance config: %s, should be round_robin, "
+            "least_conn or uri_hash",
+            balance_conf);
+        return -1;
+    }
+
+    if (parse_backends(conf))
+        return -1;
+
+    if (balance == BALANCE_URI_HASH && build_ring()) {
+        ERR("no mem for the proxy hash ring");
+        return -1;
+    }
+
+    return 0;
+}
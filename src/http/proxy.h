@@ -0,0 +1,15 @@
+#pragma once
+
+#include "http/request.h"
+
+/* Reverse proxy: every request is forwarded to one of the backends of
+ * proxy_pass over the keep-alive connections of http/client.h, and the
+ * response is streamed back. Bodies of known length are moved with splice()
+ * through a pipe, without being copied through user space.
+ */
+void http_proxy_handler(struct http_request *r);
+
+/* @backends: "host:port" separated by commas. @balance: round_robin,
+ * least_conn or uri_hash.
+ */
+int http_proxy_init(const char *backends, const char *balance);
@@ -1,14 +1,24 @@
+#define _GNU_SOURCE
 #include <ctype.h>
 #include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdlib.h>
+#include <strings.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <unistd.h>
 
+#include "coro/sched.h"
 #include "env.h"
 #include "logger.h"
+#include "process.h"
+#include "syscall_hook.h"
 #include "util/hashtable.h"
 #include "util/memcache.h"
 #include "util/net.h"
 #include "util/str.h"
+#include "util/system.h"
 
 #include "http/parse.h"
 #include "http/request.h"
@@ -17,6 +27,21 @@
 static size_t client_header_size;
 static struct memcache *http_request_cache;
 
+static int keepalive_timeout = 0; /* milliseconds, 0 disables keep-alive */
+static int keepalive_requests = 1;
+
+/* milliseconds to receive a whole request header, 0 for no limit */
+static int client_header_timeout = 0;
+
+static long long max_body_size = 16 << 20;
+
+/* Unread bodies are received here to be dropped. Shared by all coroutines of
+ * the worker, as nobody looks at what it holds.
+ */
+static char discard_buffer[16 << 10];
+
+#define SPOOL_BUFFER_SIZE (64 << 10)
+
 static struct request_line_handler request_line_handler = {NULL, NULL, NULL};
 static struct hash_table *request_header_ht;
 
@@ -30,10 +55,70 @@ static http_request_body_handler_t request_body_handler =
 
 static int http_process_content_length(struct http_request *r)
 {
-    r->content_len = str_atoi(&r->header_value);
-    if (r->content_len <= 0)
+    str_t *value = &r->header_value;
+    long long len = 0;
+
+    if (!value->len || value->len > 18)
         return -1;
 
+    for (size_t i = 0; i < value->len; i++) {
+        if (value->p[i] < '0' || value->p[i] > '9')
+            return -1;
+        len = len * 10 + value->p[i] - '0';
+    }
+
+    /* repeated headers must agree */
+    if (r->content_len >= 0 && r->content_len != len)
+        return -2;
+
+    r->content_len = len;
+    return 0;
+}
+
+/* Only chunked is supported. Other codings are refused once the header is
+ * complete, see http_init_request_body().
+ */
+static int http_process_transfer_encoding(struct http_request *r)
+{
+    static const char chunked[] = "chunked";
+
+    r->chunked = r->header_value.len == sizeof(chunked) - 1 &&
+                 !strncasecmp((char *) r->header_value.p, chunked,
+                              sizeof(chunked) - 1);
+
+    return 0;
+}
+
+/* whether the comma separated list @value contains @token */
+static bool header_has_token(str_t *value, const char *token)
+{
+    size_t len = strlen(token);
+    unsigned char *p = value->p, *end = value->p + value->len;
+
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            p++;
+
+        unsigned char *start = p;
+        while (p < end && *p != ',' && *p != ' ' && *p != '\t')
+            p++;
+
+        if ((size_t) (p - start) == len &&
+            !strncasecmp((char *) start, token, len))
+            return true;
+    }
+
+    return false;
+}
+
+static int http_process_connection(struct http_request *r)
+{
+    if (header_has_token(&r->header_value, "close"))
+        r->keep_alive = 0;
+    else if (keepalive_timeout &&
+             header_has_token(&r->header_value, "keep-alive"))
+        r->keep_alive = 1;
+
     return 0;
 }
 
@@ -90,28 +175,50 @@ static int http_process_host(struct http_request *r)
     return 0;
 }
 
-static struct request_header_handler http_headers_handler[] = {
-    {STRING("Host"), http_process_host},
-    {STRING("Connection"), NULL},
-    {STRING("If-Modified-Since"), NULL},
-    {STRING("If-Unmodified-Since"), NULL},
-    {STRING("If-Match"), NULL},
-    {STRING("If-None-Match"), NULL},
-    {STRING("User-Agent"), NULL},
-    {STRING("Referer"), NULL},
-    {STRING("Content-Length"), http_process_content_length},
-    {STRING("Content-Type"), NULL},
-    {STRING("Range"), NULL},
-    {STRING("If-Range"), NULL},
-    {STRING("Transfer-Encoding"), NULL},
-    {STRING("Expect"), NULL},
-    {STRING("Upgrade"), NULL},
-    {STRING("Authorization"), NULL},
-    {STRING("Keep-Alive"), NULL},
-    {STRING("Cookie"), NULL},
-    {NULL_STRING, NULL},
+struct known_header {
+    str_t name;
+    size_t offset; /* of the header in struct http_headers_in */
+    http_request_header_handler_t handler;
+};
+
+#define KNOWN_HEADER_BITS 6
+#define KNOWN_HEADER_SLOT(hash) ((hash) & ((1 << KNOWN_HEADER_BITS) - 1))
+
+#define KNOWN_HEADER(slot, name, field, handler) \
+    [slot] = {STRING(name), offsetof(struct http_headers_in, field), handler}
+
+/* Perfect hash of the headers in struct http_headers_in. A header sits in the
+ * slot picked by the low bits of its hash, which the parser computes over the
+ * lowercase name anyway, and the slots of these names were searched offline
+ * not to collide. http_request_init() checks every slot, so a new header
+ * whose slot is taken stops the server at start-up.
+ */
+static struct known_header known_headers[1 << KNOWN_HEADER_BITS] = {
+    KNOWN_HEADER(3, "User-Agent", user_agent, NULL),
+    KNOWN_HEADER(5, "Keep-Alive", keep_alive, NULL),
+    KNOWN_HEADER(13, "If-Range", if_range, NULL),
+    KNOWN_HEADER(14, "Content-Type", content_type, NULL),
+    KNOWN_HEADER(21, "If-Match", if_match, NULL),
+    KNOWN_HEADER(25, "Expect", expect, NULL),
+    KNOWN_HEADER(28, "Upgrade", upgrade, NULL),
+    KNOWN_HEADER(30, "Connection", connection, http_process_connection),
+    KNOWN_HEADER(32, "If-None-Match", if_none_match, NULL),
+    KNOWN_HEADER(36, "Cookie", cookie, NULL),
+    KNOWN_HEADER(38, "If-Modified-Since", if_modified_since, NULL),
+    KNOWN_HEADER(40, "Host", host, http_process_host),
+    KNOWN_HEADER(45, "Referer", referer, NULL),
+    KNOWN_HEADER(53, "Transfer-Encoding", transfer_encoding,
+                 http_process_transfer_encoding),
+    KNOWN_HEADER(57, "Authorization", authorization, NULL),
+    KNOWN_HEADER(58, "Content-Length", content_length,
+                 http_process_content_length),
+    KNOWN_HEADER(61, "Range", range, NULL),
+    KNOWN_HEADER(63, "If-Unmodified-Since", if_unmodified_since, NULL),
 };
 
+/* Read more of the request line and header. Return 0, -1 if the buffer is
+ * full, -2 if the client closed the connection, was too slow or it failed.
+ */
 static int recv_http_request(int fd, struct buffer *b)
 {
     int nread = -1;
@@ -120,18 +227,16 @@ static int recv_http_request(int fd, struct buffer *b)
         return -1;
 
     nread = recv(fd, b->last, b->end - b->last, 0);
-    if (nread < 0) {
-        if (ETIME == errno) {
-            ERR("recv timeout, client ip:%s", get_peer_ip(fd));
-            return -2;
-        } else {
-            ERR("recv http request error:%d errno:%d %s", nread, errno,
-                strerror(errno));
-            return -3;
-        }
-    } else if (nread == 0) {
-        ERR("closed by client. client addr: %s", get_peer_ip(fd));
-        return -4;
+    if (nread < 0 && ETIME == errno) {
+        INFO("recv timeout, client ip:%s", get_peer_ip(fd));
+        return -2;
+    }
+    if (nread <= 0) {
+        /* closing between requests is how a client ends the connection */
+        if (b->last != b->start)
+            INFO("connection closed within a request, client ip:%s",
+                 get_peer_ip(fd));
+        return -2;
     }
 
     b->last += nread;
@@ -139,42 +244,65 @@ static int recv_http_request(int fd, struct buffer *b)
     return 0;
 }
 
+/* Return 0, -1 to answer with 400, -2 to close the connection without */
 static int http_process_request_line(struct http_request *r)
 {
     struct buffer *b = &r->header;
 
+    /* pipelined bytes of a previous request may be buffered already */
     for (;;) {
-        int ret = recv_http_request(r->fd, b);
+        int ret = http_parse_request_line(r, b);
+        if (ret == 0) /* successful */
+            return 0;
+        if (ret < 0) {
+            ERR("parse request line error:%d", ret);
+            return -1;
+        }
+
+        ret = recv_http_request(r->fd, b);
+        if (ret == -2)
+            return -2;
         if (ret) {
             ERR("recv http request line error:%d", ret);
             return -1;
         }
-
-        ret = http_parse_request_line(r, b);
-        if (ret == 0) /* successful */
-            return 0;
-        if (ret > 0)
-            continue;
-
-        /* encounter errors */
-        ERR("parse request line error:%d", ret);
-        return -2;
     }
 }
 
+static inline bool header_name_is(struct http_request *r, str_t *name)
+{
+    return r->header_name.len == name->len &&
+           !strncasecmp((char *) r->header_name.p, (char *) name->p, name->len);
+}
+
 static int handle_http_request_header(struct http_request *r)
 {
     if (r->invalid_header)
         return 0;
 
+    struct known_header *kh =
+        &known_headers[KNOWN_HEADER_SLOT(r->header_hash)];
+    if (header_name_is(r, &kh->name)) {
+        struct http_header *h =
+            (struct http_header *) ((char *) &r->headers_in + kh->offset);
+        if (!http_header_exist(h)) {
+            h->hash = r->header_hash;
+            h->key = r->header_name;
+            h->value = r->header_value;
+        }
+
+        return kh->handler ? kh->handler(r) : 0;
+    }
+
     struct request_header_handler *hh =
         hash_table_find(request_header_ht, r->header_hash);
-    if (hh && hh->handler)
+    if (hh && header_name_is(r, &hh->name))
         return hh->handler(r);
 
     return 0;
 }
 
+/* Return 0, -1 to answer with 400, -2 to close the connection without */
 static int http_process_request_header(struct http_request *r)
 {
     struct buffer *b = &r->header;
@@ -188,95 +316,376 @@ static int http_process_request_header(struct http_request *r)
             continue;
         case 1: /* continue */
             ret = recv_http_request(r->fd, b);
+            if (ret == -2)
+                return -2;
             if (ret) {
                 ERR("recv http request header error:%d", ret);
-                return -2;
+                return -1;
             }
             continue;
         case 100:
             return 0;
         default: /* error */
             ERR("parse request header error:%d", ret);
-            return -3;
+            return -1;
         }
     }
 }
 
-static int http_process_request_body(struct http_request *r)
+/* Check how the request body is framed. Return 0 or the status code to
+ * answer with.
+ */
+static int http_init_request_body(struct http_request *r)
+{
+    struct http_headers_in *in = &r->headers_in;
+
+    if (http_header_exist(&in->transfer_encoding)) {
+        if (!r->chunked)
+            return HTTP_NOT_IMPLEMENTED;
+
+        /* Transfer-Encoding wins, but a request carrying both may be an
+         * attempt to smuggle another one past a proxy.
+         */
+        if (r->content_len >= 0)
+            r->keep_alive = 0;
+        r->content_len = -1;
+        r->body_rest = -1;
+        r->body_state = B_chunk_size;
+    } else if (r->content_len > 0) {
+        if (r->content_len > max_body_size)
+            return HTTP_REQUEST_ENTITY_TOO_LARGE;
+
+        r->body_rest = r->content_len;
+        r->body_state = B_data;
+    } else {
+        return 0;
+    }
+
+    static const char continue_100[] = "100-continue";
+    r->expect_continue =
+        r->http_version >= HTTP_VER_11 && http_header_exist(&in->expect) &&
+        in->expect.value.len == sizeof(continue_100) - 1 &&
+        !strncasecmp((char *) in->expect.value.p, continue_100,
+                     sizeof(continue_100) - 1);
+
+    return 0;
+}
+
+static ssize_t recv_http_body(struct http_request *r,
+                              void *buf,
+                              size_t size,
+                              int flags)
+{
+    ssize_t n = recv(r->fd, buf, size, flags);
+    if (n > 0)
+        return n;
+
+    if (n == 0)
+        ERR("body closed by client. client addr: %s", get_peer_ip(r->fd));
+    else if (ETIME == errno)
+        ERR("recv body timeout, client ip:%s", get_peer_ip(r->fd));
+    else
+        ERR("recv http request body error:%zd errno:%d %s", n, errno,
+            strerror(errno));
+
+    return -3;
+}
+
+/* Step over chunk framing. The bytes after the request header come first,
+ * then the socket is peeked so that nothing past the body is consumed.
+ */
+static int read_chunk_framing(struct http_request *r)
 {
     struct buffer *b = &r->header;
+    int n;
 
-    while (b->last - b->pos != r->content_len) {
-        int ret = recv_http_request(r->fd, b);
-        if (ret) {
-            ERR("recv http request content error:%d", ret);
+    if (b->pos < b->last) {
+        n = http_parse_chunked(r, b->pos, b->last);
+        if (n < 0)
             return -1;
+        b->pos += n;
+        return 0;
+    }
+
+    unsigned char framing[64];
+    ssize_t nread = recv_http_body(r, framing, sizeof(framing), MSG_PEEK);
+    if (nread < 0)
+        return nread;
+
+    n = http_parse_chunked(r, framing, framing + nread);
+    if (n < 0)
+        return -1;
+
+    return (recv_http_body(r, framing, n, 0) == n) ? 0 : -3;
+}
+
+static void send_continue(struct http_request *r)
+{
+    static const char continue_100[] = "HTTP/1.1 100 Continue" CRLF CRLF;
+
+    r->expect_continue = 0;
+    send(r->fd, continue_100, sizeof(continue_100) - 1, 0);
+}
+
+ssize_t http_read_body(struct http_request *r, void *buf, size_t size)
+{
+    struct buffer *b = &r->header;
+    ssize_t n;
+
+    if (r->expect_continue)
+        send_continue(r);
+
+    while (r->body_state != B_data) {
+        if (r->body_state == B_done)
+            return 0;
+
+        n = read_chunk_framing(r);
+        if (n == -1)
+            ERR("invalid chunked body, client ip:%s", get_peer_ip(r->fd));
+        if (n)
+            goto fail;
+    }
+
+    if ((long long) size > r->body_rest)
+        size = r->body_rest;
+
+    if (b->pos < b->last) {
+        n = b->last - b->pos;
+        if ((size_t) n > size)
+            n = size;
+        memcpy(buf, b->pos, n);
+        b->pos += n;
+    } else {
+        n = recv_http_body(r, buf, size, 0);
+        if (n < 0)
+            goto fail;
+    }
+
+    r->body_received += n;
+    if (r->body_received > max_body_size) {
+        ERR("request body larger than %lld bytes", max_body_size);
+        n = -2;
+        goto fail;
+    }
+
+    r->body_rest -= n;
+    if (!r->body_rest)
+        r->body_state = r->chunked ? B_chunk_data_cr : B_done;
+
+    return n;
+
+fail:
+    /* the connection cannot be parsed any further */
+    r->keep_alive = 0;
+    r->body_state = B_done;
+    return n;
+}
+
+long long http_take_body(struct http_request *r, str_t *buffered)
+{
+    struct buffer *b = &r->header;
+
+    str_init(buffered);
+    if (r->chunked)
+        return -1;
+    if (r->body_state == B_done)
+        return 0;
+
+    if (r->expect_continue)
+        send_continue(r);
+
+    size_t n = b->last - b->pos;
+    if ((long long) n > r->body_rest)
+        n = r->body_rest;
+    buffered->p = b->pos;
+    buffered->len = n;
+    b->pos += n;
+
+    long long rest = r->body_rest - n;
+    r->body_received += r->body_rest;
+    r->body_rest = 0;
+    r->body_state = B_done;
+
+    return rest;
+}
+
+int http_spool_body(struct http_request *r)
+{
+    if (r->body_fd < 0) {
+        r->body_fd = memfd_create("cserv-body", MFD_CLOEXEC);
+        if (r->body_fd < 0) {
+            ERR("Failed to create body file: %s", strerror(errno));
+            r->keep_alive = 0;
+            return -4;
         }
     }
 
-    r->content.p = b->pos;
-    r->content.len = r->content_len;
+    char *buf = malloc(SPOOL_BUFFER_SIZE);
+    if (!buf) {
+        ERR("no mem to spool request body");
+        r->keep_alive = 0;
+        return -4;
+    }
 
-    return 0;
+    ssize_t n;
+    while ((n = http_read_body(r, buf, SPOOL_BUFFER_SIZE)) > 0) {
+        for (ssize_t done = 0; done < n;) {
+            ssize_t written = write(r->body_fd, buf + done, n - done);
+            if (written < 0) {
+                ERR("Failed to spool request body: %s", strerror(errno));
+                free(buf);
+                r->keep_alive = 0;
+                return -4;
+            }
+            done += written;
+        }
+    }
+
+    free(buf);
+    if (n < 0)
+        return n;
+
+    lseek(r->body_fd, 0, SEEK_SET);
+    return r->body_fd;
 }
 
-static void __http_request_handler(struct http_request *r)
+/* Drop what the handler did not read so that the next request can be parsed.
+ * A client still waiting for "100 Continue" never sent the body at all.
+ */
+static void http_finish_request_body(struct http_request *r)
 {
-    if (http_process_request_line(r)) {
-        http_finalize_request(r, HTTP_BAD_REQUEST);
-        return;
+    if (r->expect_continue)
+        r->keep_alive = 0;
+
+    while (r->keep_alive &&
+           http_read_body(r, discard_buffer, sizeof(discard_buffer)) > 0)
+        ;
+
+    if (r->body_fd >= 0) {
+        close(r->body_fd);
+        r->body_fd = -1;
     }
+}
 
-    if (request_line_handler.method && request_line_handler.method(r))
+static void __http_request_handler(struct http_request *r)
+{
+    int ret = http_process_request_line(r);
+    if (ret) {
+        if (ret == -1)
+            http_finalize_request(r, HTTP_BAD_REQUEST);
         return;
+    }
 
-    if (request_line_handler.uri && request_line_handler.uri(r))
-        return;
+    /* HTTP/1.1 persists by default, HTTP/1.0 only on request */
+    r->requests++;
+    r->keep_alive = keepalive_timeout && r->http_version >= HTTP_VER_11;
 
-    if (request_line_handler.http && request_line_handler.http(r))
+    if ((request_line_handler.method && request_line_handler.method(r)) ||
+        (request_line_handler.uri && request_line_handler.uri(r)) ||
+        (request_line_handler.http && request_line_handler.http(r))) {
+        r->keep_alive = 0; /* the request header was not consumed */
         return;
+    }
 
     if (r->http_version < HTTP_VER_10) {
+        r->keep_alive = 0;
+        set_coro_deadline(0);
         request_body_handler(r);
         return;
     }
 
-    if (http_process_request_header(r)) {
-        http_finalize_request(r, HTTP_BAD_REQUEST);
+    if ((ret = http_process_request_header(r))) {
+        r->keep_alive = 0;
+        if (ret == -1)
+            http_finalize_request(r, HTTP_BAD_REQUEST);
         return;
     }
+    set_coro_deadline(0); /* the body and response have their own timeouts */
 
-    if (http_process_request_body(r)) {
-        http_finalize_request(r, HTTP_INSUFFICIENT_STORAGE);
+    if (r->requests >= keepalive_requests || g_shall_stop)
+        r->keep_alive = 0;
+
+    int ret_code = http_init_request_body(r);
+    if (ret_code) {
+        r->keep_alive = 0;
+        http_finalize_request(r, ret_code);
         return;
     }
 
     request_body_handler(r);
 }
 
-void http_request_handler(int fd)
+static void http_request_reset(struct http_request *r)
+{
+    r->state = 0;
+    str_init(&r->request_line);
+    r->method = HTTP_UNKNOWN;
+    r->args = NULL;
+    str_init(&r->exten);
+    str_init(&r->http_protocol);
+    r->complex_uri = r->quoted_uri = r->plus_in_uri = r->space_in_uri = 0;
+    r->keep_alive = 0;
+    r->content_len = -1;
+    r->chunked = r->expect_continue = 0;
+    r->body_state = B_done;
+    r->body_rest = r->body_received = 0;
+    memset(&r->headers_in, 0, sizeof(struct http_headers_in));
+    r->header_hash = 0;
+    r->lowcase_index = 0;
+}
+
+/* Move the pipelined bytes to the buffer head. Return 0 if there is a request
+ * to be parsed, 1 if the connection is idle.
+ */
+static int http_next_request(struct http_request *r)
+{
+    struct buffer *b = &r->header;
+    size_t rest = b->last - b->pos;
+
+    memmove(b->start, b->pos, rest);
+    b->pos = b->start;
+    b->last = b->start + rest;
+
+    return rest ? 0 : 1;
+}
+
+/* An idle connection is parked between requests: it gives its request and
+ * header buffer back, and only the count of requests served is kept.
+ */
+int http_request_handler(int fd, struct conn_park *park)
 {
     struct http_request *r = memcache_alloc(http_request_cache);
     if (!r) {
         ERR("no mem for http request");
         http_fast_response(fd, HTTP_INSUFFICIENT_STORAGE_PAGE,
                            sizeof(HTTP_INSUFFICIENT_STORAGE_PAGE) - 1);
-        return;
+        return 0;
     }
 
     r->fd = fd;
-    r->state = 0;
-    str_init(&r->request_line);
-    r->args = NULL;
-    str_init(&r->exten);
-    str_init(&r->http_protocol);
-    r->content_len = 0;
-
+    r->requests = park->data;
     bind_buffer(&r->header, (char *) r + sizeof(struct http_request),
-                client_header_size - sizeof(struct http_request));
-
-    __http_request_handler(r);
+                client_header_size);
+
+    int idle = 0;
+    r->body_fd = -1;
+    do {
+        http_request_reset(r);
+        /* a header trickling in byte by byte still has to make it in time */
+        set_coro_deadline(client_header_timeout);
+        __http_request_handler(r);
+        http_finish_request_body(r);
+    } while (r->keep_alive && !(idle = http_next_request(r)));
+
+    set_coro_deadline(0);
+
+    if (idle) {
+        park->timeout = keepalive_timeout;
+        park->data = r->requests;
+    }
     memcache_free(http_request_cache, r);
+
+    return idle;
 }
 
 static unsigned hash_key_lc(unsigned char *data, size_t len)
@@ -289,6 +698,23 @@ static unsigned hash_key_lc(unsigned char *data, size_t len)
     return key;
 }
 
+static void check_known_headers()
+{
+    for (size_t i = 0; i < ARRAY_SIZE(known_headers); i++) {
+        str_t *name = &known_headers[i].name;
+        if (!name->len)
+            continue;
+
+        unsigned key = hash_key_lc(name->p, name->len);
+        if (KNOWN_HEADER_SLOT(key) != i) {
+            ERR("known header %.*s belongs to slot %u, not %zu",
+                (int) name->len, name->p, KNOWN_HEADER_SLOT(key), i);
+            exit(-1);
+        }
+    }
+}
+
+/* Handlers of known headers replace the builtin ones, others are hashed */
 static void add_client_header_handler(struct request_header_handler *handler)
 {
     if (!handler)
@@ -299,6 +725,14 @@ static void add_client_header_handler(struct request_header_handler *handler)
             continue;
 
         unsigned key = hash_key_lc(handler->name.p, handler->name.len);
+        struct known_header *kh = &known_headers[KNOWN_HEADER_SLOT(key)];
+        if (kh->name.len == handler->name.len &&
+            !strncasecmp((char *) kh->name.p, (char *) handler->name.p,
+                         handler->name.len)) {
+            kh->handler = handler->handler;
+            continue;
+        }
+
         if (hash_table_add(request_header_ht, key, handler)) {
             ERR("r handler conflict. key:%u, handler:%.*s", key,
                 handler->name.len, handler->name.p);
@@ -318,8 +752,8 @@ void http_request_init(size_t client_header_buffer_kbytes,
         memcpy(&request_line_handler, line_handler,
                sizeof(struct request_line_handler));
 
-    http_request_cache =
-        memcache_create(client_header_size, g_worker_connections);
+    http_request_cache = memcache_create(
+        sizeof(struct http_request) + client_header_size, g_worker_connections);
     if (!http_request_cache) {
         ERR("Failed to create memcache for HTTP request header");
         exit(-1);
@@ -331,8 +765,26 @@ void http_request_init(size_t client_header_buffer_kbytes,
         exit(-2);
     }
 
-    add_client_header_handler(http_headers_handler);
+    check_known_headers();
     add_client_header_handler(header_handler);
     if (body_handler)
         request_body_handler = body_handler;
 }
+
+void http_body_init(long long max_body_bytes)
+{
+    max_body_size = max_body_bytes;
+}
+
+/* @milliseconds 0 lets clients take as long as they like */
+void http_header_timeout_init(int milliseconds)
+{
+    client_header_timeout = milliseconds;
+}
+
+/* @timeout_seconds 0 disables persistent connections */
+void http_keepalive_init(int timeout_seconds, int max_requests)
+{
+    keepalive_timeout = timeout_seconds * 1000;
+    keepalive_requests = max_requests;
+}
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <sys/types.h>
+
+#include "process.h"
 #include "util/buffer.h"
 #include "util/str.h"
 
@@ -54,9 +57,10 @@ struct http_headers_in {
     struct http_header authorization;
 
     struct http_header keep_alive;
+    struct http_header cookie;
 };
 
-#define http_header_exist(header) (header->key.p)
+#define http_header_exist(header) ((header)->key.p)
 #define HTTP_LC_HEADER_LEN 32
 
 struct http_request {
@@ -83,9 +87,22 @@ struct http_request {
     unsigned quoted_uri : 1;   /* URI with "%" */
     unsigned plus_in_uri : 1;  /* URI with "+" */
     unsigned space_in_uri : 1; /* URI with " " */
+    unsigned keep_alive : 1;   /* connection persists after the response */
+
+    int requests; /* requests served on this connection so far */
+
+    /* request body, pulled by the handler with http_read_body() */
+    long long content_len; /* -1 without Content-Length */
+    unsigned chunked : 1;
+    unsigned expect_continue : 1; /* "100 Continue" not sent yet */
+    int body_state;
+    long long body_rest;     /* left in the body or in the current chunk */
+    int chunk_extra;         /* bytes of a chunk extension or the trailer */
+    long long body_received; /* body bytes read so far */
+    int body_fd;             /* spooled body, or -1 */
 
-    int content_len;
-    str_t content;
+    /* known headers, the first occurrence of each */
+    struct http_headers_in headers_in;
 
     /* used to parse HTTP headers */
     str_t header_name;
@@ -114,8 +131,33 @@ struct request_header_handler {
 /* request body, the rest */
 typedef void (*http_request_body_handler_t)(struct http_request *r);
 
-void http_request_handler(int fd);
+int http_request_handler(int fd, struct conn_park *park);
 void http_request_init(size_t client_header_buffer_kbytes,
                        struct request_line_handler *line_handler,
                        struct request_header_handler *header_handler,
                        http_request_body_handler_t body_handler);
+void http_header_timeout_init(int milliseconds);
+void http_keepalive_init(int timeout_seconds, int max_requests);
+void http_body_init(long long max_body_bytes);
+
+/* Read up to @size bytes of the request body, decoding chunked transfer
+ * encoding. Return the number of bytes read, 0 at the end of the body, -1 on
+ * malformed encoding, -2 if the body is larger than client_max_body_mbytes
+ * and -3 on receive errors. Whatever the handler leaves unread is discarded
+ * before the next request of the connection.
+ */
+ssize_t http_read_body(struct http_request *r, void *buf, size_t size);
+
+/* Read the rest of the request body into an anonymous memory file. Return
+ * its fd, positioned at the start and closed after the request, or < 0 as
+ * http_read_body() does, -4 if the file cannot be created.
+ */
+int http_spool_body(struct http_request *r);
+
+/* Take over the rest of a Content-Length request body, e.g. to splice() it
+ * elsewhere. @buffered is set to the body bytes that came with the header,
+ * the number of bytes still to be received from r->fd is returned, -1 for a
+ * chunked body. The body counts as read: if the caller fails to consume it
+ * all, it must clear r->keep_alive.
+ */
+long long http_take_body(struct http_request *r, str_t *buffered);
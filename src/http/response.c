@@ -1,4 +1,6 @@
+#include <errno.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 #include "http/request.h"
 #include "http/response.h"
@@ -317,37 +319,190 @@ void http_fast_response(int fd, const char *content, size_t len)
     send(fd, content, len, 0);
 }
 
-void http_finalize_request(struct http_request *r, int ret_code)
+static inline char *append(char *p, const void *data, size_t len)
 {
-    struct buffer *b = &r->header;
-    str_t *status_line = get_http_status_line(ret_code);
-    if (!status_line)
-        return;
+    memcpy(p, data, len);
+    return p + len;
+}
+
+#define APPEND(p, literal) append(p, literal, sizeof(literal) - 1)
+
+/* room kept for Content-Length, Connection and the blank line */
+#define HEADER_TAIL_SIZE 64
+
+int http_response_init(struct http_response *resp,
+                       struct http_request *r,
+                       int status)
+{
+    resp->r = r;
+    resp->error = 0;
+    resp->nsegs = 0;
+    resp->content_length = 0;
+
+    str_t *status_line = get_http_status_line(status);
+    if (!status_line) {
+        resp->error = 1;
+        return -1;
+    }
+
+    char *p = resp->header;
+    p = APPEND(p, "HTTP/1.1 ");
+    p = append(p, status_line->p, status_line->len);
+    p = APPEND(p, CRLF HTTP_SERVER_HEADER);
+    resp->last = p;
+
+    return 0;
+}
+
+int http_response_header(struct http_response *resp,
+                         const char *name,
+                         const void *value,
+                         size_t len)
+{
+    size_t name_len = strlen(name);
+
+    if (resp->error)
+        return -1;
+
+    if (resp->last + name_len + len + 4 + HEADER_TAIL_SIZE >
+        resp->header + sizeof(resp->header)) {
+        ERR("response header too large, adding %s", name);
+        resp->error = 1;
+        return -2;
+    }
 
-    b->pos = b->last = b->start;
-    memcpy(b->start, "HTTP/1.1 ", sizeof("HTTP/1.1 ") - 1);
-    b->pos += sizeof("HTTP/1.1 ") - 1;
+    char *p = resp->last;
+    p = append(p, name, name_len);
+    p = APPEND(p, ": ");
+    p = append(p, value, len);
+    p = APPEND(p, CRLF);
+    resp->last = p;
 
-    memcpy(b->pos, status_line->p, status_line->len);
-    b->pos += status_line->len;
+    return 0;
+}
+
+int http_response_body(struct http_response *resp,
+                       const void *data,
+                       size_t len)
+{
+    if (resp->error)
+        return -1;
+
+    if (resp->nsegs == HTTP_RESPONSE_SEGMENTS) {
+        ERR("too many response body segments");
+        resp->error = 1;
+        return -2;
+    }
+
+    if (!len)
+        return 0;
+
+    struct iovec *iov = &resp->iov[1 + resp->nsegs++];
+    iov->iov_base = (void *) data;
+    iov->iov_len = len;
+    resp->content_length += len;
+
+    return 0;
+}
+
+static void finish_header(struct http_response *resp, size_t content_length)
+{
+    char *p = resp->last;
+
+    p = APPEND(p, "Content-Length: ");
+    p = append_size(p, content_length);
+    if (resp->r->keep_alive)
+        p = APPEND(p, CRLF "Connection: keep-alive" CRLF CRLF);
+    else
+        p = APPEND(p, CRLF "Connection: close" CRLF CRLF);
+
+    resp->iov[0].iov_base = resp->header;
+    resp->iov[0].iov_len = p - resp->header;
+}
 
-    memcpy(b->pos, CRLF HTTP_ERROR_HEADER, 2 + sizeof(HTTP_ERROR_HEADER) - 1);
-    b->pos += 2 + sizeof(HTTP_ERROR_HEADER) - 1;
+int http_send_iovecs(int fd, struct iovec *iov, int iovcnt)
+{
+    while (iovcnt) {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n < 0)
+            return (n == -3) ? -3 : -1;
+
+        for (; iovcnt && (size_t) n >= iov->iov_len; iov++, iovcnt--)
+            n -= iov->iov_len;
+
+        if (iovcnt) {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    return 0;
+}
+
+int http_response_send(struct http_response *resp)
+{
+    struct http_request *r = resp->r;
+
+    if (resp->error) {
+        r->keep_alive = 0;
+        return -1;
+    }
+
+    finish_header(resp, resp->content_length);
+
+    int iovcnt = 1 + resp->nsegs;
+    if (r->method == HTTP_HEAD)
+        iovcnt = 1;
+
+    if (http_send_iovecs(r->fd, resp->iov, iovcnt)) {
+        ERR("send response error, errno:%d %s", errno, strerror(errno));
+        r->keep_alive = 0;
+        return -3;
+    }
+
+    return 0;
+}
+
+int http_response_send_header(struct http_response *resp,
+                              off_t content_length)
+{
+    struct http_request *r = resp->r;
+
+    if (resp->error) {
+        r->keep_alive = 0;
+        return -1;
+    }
+
+    finish_header(resp, content_length);
+    if (http_send_iovecs(r->fd, resp->iov, 1)) {
+        ERR("send response header error, errno:%d %s", errno,
+            strerror(errno));
+        r->keep_alive = 0;
+        return -3;
+    }
+
+    return 0;
+}
+
+void http_finalize_request(struct http_request *r, int ret_code)
+{
+    struct http_response resp;
+
+    if (http_response_init(&resp, r, ret_code))
+        return;
+
+    static const char content_type[] = "text/html";
+    http_response_header(&resp, "Content-Type", content_type,
+                         sizeof(content_type) - 1);
 
     if (ret_code == 200) {
-        memcpy(b->pos, CRLF, 2);
-        b->pos += 2;
-        memcpy(b->pos, http_error_200_page, sizeof(http_error_200_page) - 1);
-        b->pos += sizeof(http_error_200_page) - 1;
+        http_response_body(&resp, http_error_200_page,
+                           sizeof(http_error_200_page) - 1);
     } else {
         str_t *error_page = get_http_error_page(ret_code);
-        if (error_page) {
-            memcpy(b->pos, CRLF, 2);
-            b->pos += 2;
-            memcpy(b->pos, error_page->p, error_page->len);
-            b->pos += error_page->len;
-        }
+        if (error_page)
+            http_response_body(&resp, error_page->p, error_page->len);
     }
 
-    send(r->fd, b->start, b->pos - b->start, 0);
+    http_response_send(&resp);
 }
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <sys/types.h>
+#include <sys/uio.h>
+
 #include "http/request.h"
 
 #define HTTP_CONTINUE 100
@@ -39,9 +42,10 @@
 #define HTTP_GATEWAY_TIME_OUT 504
 #define HTTP_INSUFFICIENT_STORAGE 507
 
-#define HTTP_ERROR_HEADER                                   \
-    "Server: cserv/dev" CRLF "Content-Type: text/html" CRLF \
-    "Connection: Close" CRLF
+#define HTTP_SERVER_HEADER "Server: cserv/dev" CRLF
+#define HTTP_RESPONSE_HEADER HTTP_SERVER_HEADER "Content-Type: text/html" CRLF
+
+#define HTTP_ERROR_HEADER HTTP_RESPONSE_HEADER "Connection: Close" CRLF
 
 #define HTTP_INSUFFICIENT_STORAGE_PAGE                                        \
     "HTTP/1.1 507 Insufficient Storage" CRLF HTTP_ERROR_HEADER CRLF           \
@@ -49,5 +53,54 @@
     "<body bgcolor=\"white\">" CRLF                                           \
     "<center><h1>507 Insufficient Storage</h1></center>" CRLF
 
+#define HTTP_RESPONSE_HEADER_SIZE 512
+#define HTTP_RESPONSE_SEGMENTS 8
+
+/* A response collected as an iovec array and written with one writev().
+ * Header fields are formatted into @header, while body segments point at
+ * memory of the caller, e.g. static pages, cached items or mmap'd files,
+ * which must stay valid until the response is sent. Small enough to live on
+ * the coroutine stack.
+ */
+struct http_response {
+    struct http_request *r;
+    char *last; /* end of the header fields so far */
+    int error;  /* a field or segment did not fit */
+    int nsegs;
+    size_t content_length;
+    struct iovec iov[1 + HTTP_RESPONSE_SEGMENTS]; /* header, then the body */
+    char header[HTTP_RESPONSE_HEADER_SIZE];
+};
+
+/* Calls return 0 on success and < 0 once the response cannot be built or
+ * sent, in which case the connection is not kept alive.
+ */
+int http_response_init(struct http_response *resp,
+                       struct http_request *r,
+                       int status);
+int http_response_header(struct http_response *resp,
+                         const char *name,
+                         const void *value,
+                         size_t len);
+int http_response_body(struct http_response *resp,
+                       const void *data,
+                       size_t len);
+
+/* Send the header and the body segments. Content-Length and Connection are
+ * added here, the body is left out for HEAD requests.
+ */
+int http_response_send(struct http_response *resp);
+
+/* Send the header only, for a body of @content_length bytes that the caller
+ * writes itself, e.g. with sendfile().
+ */
+int http_response_send_header(struct http_response *resp,
+                              off_t content_length);
+
+/* writev() until every byte is sent, resuming after short writes. Return 0,
+ * -3 on timeout or -1 on other failures.
+ */
+int http_send_iovecs(int fd, struct iovec *iov, int iovcnt);
+
 void http_fast_response(int fd, const char *content, size_t len);
 void http_finalize_request(struct http_request *r, int ret_code);
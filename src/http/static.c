@@ -0,0 +1,441 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "util/hashtable.h"
+#include "util/list.h"
+#include "util/net.h"
+#include "util/str.h"
+#include "util/system.h"
+
+#include "http/response.h"
+#include "http/static.h"
+
+#define INDEX_FILE "index.html"
+
+#define OPEN_FILE_VALID (5 * 1000) /* re-stat cached files after 5 seconds */
+
+struct open_file {
+    struct list_head lru; /* most recently used first */
+    unsigned key;
+    int fd;
+    int refs; /* the cache and every request sending from fd */
+
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    long long validated; /* time of the last stat, in milliseconds */
+    char last_modified[32];
+
+    char path[];
+};
+
+struct mime_type {
+    str_t exten;
+    const char *type;
+};
+
+static struct mime_type mime_types[] = {
+    {STRING("html"), "text/html"},
+    {STRING("htm"), "text/html"},
+    {STRING("css"), "text/css"},
+    {STRING("js"), "application/javascript"},
+    {STRING("json"), "application/json"},
+    {STRING("xml"), "text/xml"},
+    {STRING("txt"), "text/plain"},
+    {STRING("png"), "image/png"},
+    {STRING("jpg"), "image/jpeg"},
+    {STRING("jpeg"), "image/jpeg"},
+    {STRING("gif"), "image/gif"},
+    {STRING("svg"), "image/svg+xml"},
+    {STRING("ico"), "image/x-icon"},
+    {STRING("webp"), "image/webp"},
+    {STRING("woff"), "font/woff"},
+    {STRING("woff2"), "font/woff2"},
+    {STRING("pdf"), "application/pdf"},
+    {STRING("zip"), "application/zip"},
+    {STRING("gz"), "application/gzip"},
+    {STRING("wasm"), "application/wasm"},
+    {STRING("mp4"), "video/mp4"},
+    {NULL_STRING, NULL},
+};
+
+#define DEFAULT_MIME_TYPE "application/octet-stream"
+
+static char doc_root[PATH_MAX];
+static size_t doc_root_len;
+
+static struct hash_table *open_files; /* NULL if the cache is disabled */
+static struct list_head open_files_lru;
+static int open_files_count, open_files_max;
+
+static const char *get_mime_type(struct http_request *r, const char *path)
+{
+    str_t exten = r->exten;
+
+    /* r->exten runs to the end of the URI, query string included */
+    for (size_t i = 0; i < exten.len; i++) {
+        if (exten.p[i] == '?' || exten.p[i] == '#') {
+            exten.len = i;
+            break;
+        }
+    }
+
+    if (!exten.p || !exten.len) {
+        const char *dot = strrchr(path, '.');
+        if (!dot || strchr(dot, '/'))
+            return DEFAULT_MIME_TYPE;
+
+        exten.p = (unsigned char *) dot + 1;
+        exten.len = strlen(dot + 1);
+    }
+
+    for (struct mime_type *m = mime_types; m->type; m++) {
+        if (m->exten.len == exten.len &&
+            !strncasecmp((char *) m->exten.p, (char *) exten.p, exten.len))
+            return m->type;
+    }
+
+    return DEFAULT_MIME_TYPE;
+}
+
+/* Decode the path of r->uri into *@mapped, after the document root. The
+ * buffer belongs to the request, as opening the file may yield, and is to be
+ * freed by the caller. Return the length of the path, -1 on malformed URI,
+ * -2 if too long, -3 if it would escape the document root and -4 if out of
+ * memory.
+ */
+static int map_uri(struct http_request *r, char **mapped)
+{
+    unsigned char *u = r->uri.p, *end = r->uri.p + r->uri.len;
+    int ret;
+
+    if (!r->uri.len || *u != '/')
+        return -1;
+
+    /* decoding never makes the path longer */
+    size_t size = doc_root_len + r->uri.len + sizeof(INDEX_FILE);
+    if (size > PATH_MAX)
+        size = PATH_MAX;
+
+    char *path = malloc(size);
+    if (!path)
+        return -4;
+
+    char *p = path + doc_root_len;
+    char *last = path + size - sizeof(INDEX_FILE);
+    memcpy(path, doc_root, doc_root_len);
+
+    for (; u < end && *u != '?' && *u != '#'; u++) {
+        int ch = *u;
+        if (ch == '%') {
+            if (end - u < 3 || hex_value(u[1]) < 0 || hex_value(u[2]) < 0) {
+                ret = -1;
+                goto fail;
+            }
+
+            ch = (hex_value(u[1]) << 4) | hex_value(u[2]);
+            if (!ch) {
+                ret = -1;
+                goto fail;
+            }
+            u += 2;
+        }
+
+        if (p == last) {
+            ret = -2;
+            goto fail;
+        }
+        *p++ = ch;
+
+        /* a ".." segment, checked on the decoded path */
+        if (ch == '/' && p - path >= (long) doc_root_len + 4 &&
+            !memcmp(p - 4, "/../", 4)) {
+            ret = -3;
+            goto fail;
+        }
+    }
+
+    if (p - path >= (long) doc_root_len + 3 && !memcmp(p - 3, "/..", 3)) {
+        ret = -3;
+        goto fail;
+    }
+
+    if (p[-1] == '/') {
+        memcpy(p, INDEX_FILE, sizeof(INDEX_FILE) - 1);
+        p += sizeof(INDEX_FILE) - 1;
+    }
+    *p = '\0';
+
+    *mapped = path;
+    return p - path;
+
+fail:
+    free(path);
+    return ret;
+}
+
+static unsigned hash_path(const char *path, size_t len)
+{
+    unsigned key = 0;
+
+    for (size_t i = 0; i < len; i++)
+        key = HASH(key, (unsigned char) path[i]);
+
+    return key;
+}
+
+static void open_file_put(struct open_file *f)
+{
+    if (--f->refs)
+        return;
+
+    close(f->fd);
+    free(f);
+}
+
+/* drop @f from the cache, requests still sending from it keep it open */
+static void open_file_evict(struct open_file *f)
+{
+    hash_table_remove(open_files, f->key);
+    list_del_init(&f->lru); /* tells it is no longer cached */
+    open_files_count--;
+    open_file_put(f);
+}
+
+static struct open_file *open_file_create(const char *path, size_t len)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st))
+        goto fail;
+
+    if (!S_ISREG(st.st_mode)) {
+        errno = S_ISDIR(st.st_mode) ? EISDIR : EACCES;
+        goto fail;
+    }
+
+    struct open_file *f = malloc(sizeof(struct open_file) + len + 1);
+    if (!f) {
+        errno = ENOMEM;
+        goto fail;
+    }
+
+    INIT_LIST_HEAD(&f->lru);
+    f->fd = fd;
+    f->refs = 1;
+    f->ino = st.st_ino;
+    f->size = st.st_size;
+    f->mtime = st.st_mtime;
+    f->validated = get_curr_mseconds();
+    memcpy(f->path, path, len + 1);
+
+    struct tm tm;
+    strftime(f->last_modified, sizeof(f->last_modified),
+             "%a, %d %b %Y %H:%M:%S GMT", gmtime_r(&st.st_mtime, &tm));
+
+    return f;
+
+fail:
+    close(fd);
+    return NULL;
+}
+
+/* Return the open file of @path with a reference held, or NULL with errno */
+static struct open_file *open_file_get(const char *path, size_t len)
+{
+    unsigned key = hash_path(path, len);
+    struct open_file *f = NULL;
+
+    if (open_files)
+        f = hash_table_find(open_files, key);
+
+    if (f && !strcmp(f->path, path)) {
+        if (get_curr_mseconds() - f->validated < OPEN_FILE_VALID)
+            goto hit;
+
+        /* stat() may yield, and another request evict @f meanwhile */
+        struct stat st;
+        f->refs++;
+        bool valid = !stat(path, &st) && st.st_ino == f->ino &&
+                     st.st_size == f->size && st.st_mtime == f->mtime;
+        bool cached = !list_empty(&f->lru);
+
+        if (valid) {
+            f->validated = get_curr_mseconds();
+            if (cached) {
+                list_del(&f->lru);
+                list_add(&f->lru, &open_files_lru);
+            }
+            return f;
+        }
+
+        if (cached)
+            open_file_evict(f); /* changed on disk */
+        open_file_put(f);
+        f = NULL;
+    }
+
+    bool cacheable = open_files && !f; /* the key may belong to another path */
+    f = open_file_create(path, len);
+    if (!f || !cacheable)
+        return f;
+
+    f->key = key;
+    if (hash_table_add(open_files, key, f))
+        return f;
+
+    f->refs++;
+    list_add(&f->lru, &open_files_lru);
+    if (++open_files_count > open_files_max)
+        open_file_evict(
+            list_entry(open_files_lru.prev, struct open_file, lru));
+
+    return f;
+
+hit:
+    list_del(&f->lru);
+    list_add(&f->lru, &open_files_lru);
+    f->refs++;
+
+    return f;
+}
+
+static int send_header(struct http_request *r,
+                       struct open_file *f,
+                       const char *mime_type)
+{
+    struct http_response resp;
+
+    http_response_init(&resp, r, HTTP_OK);
+    http_response_header(&resp, "Content-Type", mime_type, strlen(mime_type));
+    http_response_header(&resp, "Last-Modified", f->last_modified,
+                         strlen(f->last_modified));
+
+    return http_response_send_header(&resp, f->size);
+}
+
+/* sendfile() is hooked, waiting for room in the socket is done there */
+static int send_file(int sockfd, struct open_file *f)
+{
+    off_t offset = 0;
+
+    while (offset < f->size) {
+        ssize_t n = sendfile(sockfd, f->fd, &offset, f->size - offset);
+        if (n > 0)
+            continue;
+
+        if (n == 0) { /* truncated meanwhile */
+            ERR("file %s shrank while sending", f->path);
+            return -1;
+        }
+
+        if (errno == ETIME) {
+            ERR("sendfile timeout, client ip:%s", get_peer_ip(sockfd));
+            return -3;
+        }
+
+        ERR("sendfile error:%d %s", errno, strerror(errno));
+        return -2;
+    }
+
+    return 0;
+}
+
+void http_static_handler(struct http_request *r)
+{
+    if (!(r->method & (HTTP_GET | HTTP_HEAD))) {
+        http_finalize_request(r, HTTP_NOT_ALLOWED);
+        return;
+    }
+
+    char *path;
+    int len = map_uri(r, &path);
+    if (len < 0) {
+        int ret_code = HTTP_BAD_REQUEST;
+        if (len == -2)
+            ret_code = HTTP_REQUEST_URI_TOO_LARGE;
+        else if (len == -3)
+            ret_code = HTTP_FORBIDDEN;
+        else if (len == -4)
+            ret_code = HTTP_INTERNAL_SERVER_ERROR;
+
+        http_finalize_request(r, ret_code);
+        return;
+    }
+
+    struct open_file *f = open_file_get(path, len);
+    free(path);
+    if (!f) {
+        int ret_code = HTTP_INTERNAL_SERVER_ERROR;
+        if (errno == ENOENT || errno == ENOTDIR || errno == ENAMETOOLONG)
+            ret_code = HTTP_NOT_FOUND;
+        else if (errno == EACCES || errno == EISDIR)
+            ret_code = HTTP_FORBIDDEN;
+
+        http_finalize_request(r, ret_code);
+        return;
+    }
+
+    /* header and the first file bytes leave in full frames */
+    set_tcp_cork(r->fd, 1);
+
+    int ret = 0;
+    if (r->http_version >= HTTP_VER_10)
+        ret = send_header(r, f, get_mime_type(r, f->path));
+    if (!ret && r->method != HTTP_HEAD)
+        ret = send_file(r->fd, f);
+    if (ret)
+        r->keep_alive = 0;
+
+    set_tcp_cork(r->fd, 0);
+    open_file_put(f);
+}
+
+int http_static_init(const char *root, int cache_size)
+{
+    struct stat st;
+
+    if (!realpath(root, doc_root) || stat(doc_root, &st)) {
+        ERR("invalid document root %s: %s", root, strerror(errno));
+        return -1;
+    }
+
+    if (!S_ISDIR(st.st_mode)) {
+        ERR("document root %s is not a directory", doc_root);
+        return -2;
+    }
+
+    doc_root_len = strlen(doc_root);
+    if (doc_root_len == 1) /* "/", URIs start with a slash anyway */
+        doc_root_len = 0;
+
+    INIT_LIST_HEAD(&open_files_lru);
+    open_files_count = 0;
+    open_files_max = cache_size;
+    if (!cache_size)
+        return 0;
+
+    unsigned buckets = 1;
+    while (buckets < (unsigned) cache_size)
+        buckets <<= 1;
+
+    open_files = hash_table_create(buckets);
+    if (!open_files) {
+        ERR("Failed to create hash table for open file cache");
+        return -3;
+    }
+
+    return 0;
+}
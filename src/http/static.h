@@ -0,0 +1,9 @@
+#pragma once
+
+#include "http/request.h"
+
+/* Serve files under @root. Up to @cache_size open files are kept per worker,
+ * 0 disables the cache.
+ */
+int http_static_init(const char *root, int cache_size);
+void http_static_handler(struct http_request *r);
@@ -0,0 +1,35 @@
+#include <stdlib.h>
+
+#include "logger.h"
+#include "memcached/protocol.h"
+#include "memcached/store.h"
+#include "process.h"
+#include "util/conf.h"
+#include "util/str.h"
+
+/* the store is mapped before fork, so that all workers share it */
+static int master_process_init()
+{
+    size_t mbytes = 64;
+    char *c = get_conf_entry("memcached_memory_mbytes");
+    if (!str_equal(c, "default")) {
+        mbytes = atoi(c);
+        if (mbytes < 4 || mbytes > 65536) {
+            ERR("memcached memory should between [4-65536]MiB");
+            return -1;
+        }
+    }
+
+    if (mc_store_init(mbytes)) {
+        ERR("Failed to allocate %zuMiB shared memory for memcached", mbytes);
+        return -2;
+    }
+
+    return 0;
+}
+
+__INIT static void memcached_init()
+{
+    register_service("memcached_listen", master_process_init, NULL,
+                     memcached_handler);
+}
@@ -0,0 +1,511 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "logger.h"
+#include "memcached/protocol.h"
+#include "memcached/store.h"
+#include "process.h"
+#include "syscall_hook.h"
+#include "util/net.h"
+#include "util/str.h"
+
+#define BUFFER_SIZE (16 * 1024) /* initial size of both buffers */
+#define FLUSH_SIZE (64 * 1024)  /* send once that much output is pending */
+#define LINE_MAX_LEN (8 * 1024)
+#define MAX_TOKENS 8
+
+#define REALTIME_MAXDELTA (60 * 60 * 24 * 30) /* larger exptimes are absolute */
+
+#define VERSION "1.6.0-cserv"
+
+struct mc_conn {
+    int fd;
+    bool quit;
+
+    char *rbuf;
+    size_t rsize, rpos, rlen; /* unparsed input is [rpos, rlen) */
+    size_t need;              /* input length the pending command needs */
+    size_t swallow;           /* bytes of a rejected value left to drop */
+
+    char *wbuf;
+    size_t wsize, wlen;
+};
+
+struct token {
+    char *p;
+    size_t len;
+};
+
+static int reserve(char **buf, size_t *size, size_t need)
+{
+    if (need <= *size)
+        return 0;
+
+    size_t newsize = *size;
+    while (newsize < need)
+        newsize <<= 1;
+
+    char *p = realloc(*buf, newsize);
+    if (!p)
+        return -1;
+
+    *buf = p, *size = newsize;
+    return 0;
+}
+
+/* append to the output, the room must be there */
+static inline void put(struct mc_conn *c, const void *data, size_t len)
+{
+    memcpy(c->wbuf + c->wlen, data, len);
+    c->wlen += len;
+}
+
+static void out(struct mc_conn *c, const void *data, size_t len)
+{
+    if (reserve(&c->wbuf, &c->wsize, c->wlen + len)) {
+        ERR("no mem for memcached response");
+        c->quit = true;
+        return;
+    }
+
+    put(c, data, len);
+}
+
+static int conn_flush(struct mc_conn *c)
+{
+    for (size_t sent = 0; sent < c->wlen;) {
+        ssize_t n = send(c->fd, c->wbuf + sent, c->wlen - sent, 0);
+        if (n <= 0) {
+            ERR("send memcached response error:%zd errno:%d", n, errno);
+            return -1;
+        }
+        sent += n;
+    }
+
+    c->wlen = 0;
+    if (c->wsize > FLUSH_SIZE) {
+        char *p = realloc(c->wbuf, BUFFER_SIZE);
+        if (p)
+            c->wbuf = p, c->wsize = BUFFER_SIZE;
+    }
+
+    return 0;
+}
+
+#define OUT(c, literal) out(c, literal, sizeof(literal) - 1)
+
+static int tokenize(char *line, size_t len, struct token *tokens, int max)
+{
+    int ntokens = 0;
+    char *end = line + len;
+
+    while (line < end && ntokens < max) {
+        while (line < end && *line == ' ')
+            line++;
+        if (line == end)
+            break;
+
+        tokens[ntokens].p = line;
+        while (line < end && *line != ' ')
+            line++;
+        tokens[ntokens].len = line - tokens[ntokens].p;
+        ntokens++;
+    }
+
+    return ntokens;
+}
+
+static inline bool token_is(struct token *t, const char *s)
+{
+    return t->len == strlen(s) && !memcmp(t->p, s, t->len);
+}
+
+static bool token_to_u64(struct token *t, uint64_t *value)
+{
+    uint64_t val = 0;
+
+    if (!t->len || t->len > 20)
+        return false;
+
+    for (size_t i = 0; i < t->len; i++) {
+        if (t->p[i] < '0' || t->p[i] > '9')
+            return false;
+
+        uint64_t next = val * 10 + (t->p[i] - '0');
+        if (next < val)
+            return false;
+        val = next;
+    }
+
+    *value = val;
+    return true;
+}
+
+static bool token_to_exptime(struct token *t, time_t *exptime)
+{
+    bool negative = t->len > 1 && t->p[0] == '-';
+    struct token abs = {t->p + negative, t->len - negative};
+    uint64_t val;
+
+    if (!token_to_u64(&abs, &val) || val > INT32_MAX)
+        return false;
+
+    if (negative) /* expired immediately */
+        *exptime = 1;
+    else if (val == 0)
+        *exptime = 0;
+    else if (val > REALTIME_MAXDELTA)
+        *exptime = val;
+    else
+        *exptime = time(NULL) + val;
+
+    return true;
+}
+
+static inline bool key_valid(struct token *t)
+{
+    return t->len > 0 && t->len <= MC_KEY_MAX;
+}
+
+struct get_args {
+    struct mc_conn *conn;
+    bool with_cas;
+    size_t need; /* output room the item did not find */
+};
+
+/* Runs with the store locked, and every worker waits meanwhile: copy the
+ * item into the room left in the output buffer, but do not grow it here.
+ */
+static void get_visit(void *args,
+                      const char *key,
+                      size_t nkey,
+                      uint32_t flags,
+                      const char *data,
+                      size_t nbytes,
+                      uint64_t cas)
+{
+    struct get_args *ga = args;
+    struct mc_conn *c = ga->conn;
+    char suffix[64];
+    int len;
+
+    if (ga->with_cas)
+        len = snprintf(suffix, sizeof(suffix), " %u %zu %" PRIu64 CRLF, flags,
+                       nbytes, cas);
+    else
+        len = snprintf(suffix, sizeof(suffix), " %u %zu" CRLF, flags, nbytes);
+
+    size_t total = sizeof("VALUE ") - 1 + nkey + len + nbytes + 2;
+    if (c->wlen + total > c->wsize) {
+        ga->need = total;
+        return;
+    }
+
+    put(c, "VALUE ", sizeof("VALUE ") - 1);
+    put(c, key, nkey);
+    put(c, suffix, len);
+    put(c, data, nbytes);
+    put(c, CRLF, 2);
+}
+
+static void process_get(struct mc_conn *c, char *keys, size_t len, bool cas)
+{
+    struct get_args args = {.conn = c, .with_cas = cas};
+    struct token key;
+
+    while (tokenize(keys, len, &key, 1)) {
+        if (!key_valid(&key)) {
+            OUT(c, "CLIENT_ERROR bad command line format" CRLF);
+            return;
+        }
+
+        for (;;) {
+            args.need = 0;
+            mc_get(key.p, key.len, get_visit, &args);
+            if (!args.need)
+                break;
+
+            /* make room with the store unlocked, then look again */
+            if (reserve(&c->wbuf, &c->wsize, c->wlen + args.need)) {
+                ERR("no mem for memcached response");
+                c->quit = true;
+                return;
+            }
+        }
+        len -= key.p + key.len - keys;
+        keys = key.p + key.len;
+
+        /* values of many keys are not held all at once */
+        if (c->wlen >= FLUSH_SIZE && conn_flush(c)) {
+            c->quit = true;
+            return;
+        }
+    }
+
+    OUT(c, "END" CRLF);
+}
+
+static const char *store_replies[] = {
+    [MC_STORED] = "STORED" CRLF,
+    [MC_NOT_STORED] = "NOT_STORED" CRLF,
+    [MC_EXISTS] = "EXISTS" CRLF,
+    [MC_NOT_FOUND] = "NOT_FOUND" CRLF,
+    [MC_DELETED] = "DELETED" CRLF,
+    [MC_TOUCHED] = "TOUCHED" CRLF,
+    [MC_NON_NUMERIC] = "CLIENT_ERROR cannot increment or decrement "
+                       "non-numeric value" CRLF,
+    [MC_TOO_LARGE] = "SERVER_ERROR object too large for cache" CRLF,
+    [MC_NO_MEMORY] = "SERVER_ERROR out of memory storing object" CRLF,
+};
+
+static void reply(struct mc_conn *c, enum mc_result result, bool noreply)
+{
+    if (!noreply)
+        out(c, store_replies[result], strlen(store_replies[result]));
+}
+
+/* <cmd> <key> <flags> <exptime> <bytes> [<cas>] [noreply]\r\n<data>\r\n
+ * Return 1 if done, 0 if the data block is incomplete.
+ */
+static int process_update(struct mc_conn *c,
+                          enum mc_store_mode mode,
+                          struct token *tokens,
+                          int ntokens,
+                          size_t line_len)
+{
+    int nargs = (mode == MC_CAS) ? 6 : 5;
+    uint64_t flags, nbytes, cas = 0;
+    time_t exptime;
+
+    if (ntokens < nargs || ntokens > nargs + 1 || !key_valid(&tokens[1]) ||
+        !token_to_u64(&tokens[2], &flags) || flags > UINT32_MAX ||
+        !token_to_exptime(&tokens[3], &exptime) ||
+        !token_to_u64(&tokens[4], &nbytes) ||
+        (mode == MC_CAS && !token_to_u64(&tokens[5], &cas))) {
+        OUT(c, "CLIENT_ERROR bad command line format" CRLF);
+        c->rpos += line_len;
+        return 1;
+    }
+
+    bool noreply = ntokens > nargs && token_is(&tokens[nargs], "noreply");
+    if (nbytes > mc_value_max()) {
+        reply(c, MC_TOO_LARGE, noreply);
+        c->rpos += line_len;
+        c->swallow = nbytes + 2;
+        return 1;
+    }
+
+    c->need = line_len + nbytes + 2;
+    if (c->rlen - c->rpos < c->need)
+        return 0;
+    c->need = 0;
+
+    char *data = c->rbuf + c->rpos + line_len;
+    c->rpos += line_len + nbytes + 2;
+    if (data[nbytes] != '\r' || data[nbytes + 1] != '\n') {
+        OUT(c, "CLIENT_ERROR bad data chunk" CRLF);
+        return 1;
+    }
+
+    reply(c,
+          mc_store(mode, tokens[1].p, tokens[1].len, flags, exptime, data,
+                   nbytes, cas),
+          noreply);
+    return 1;
+}
+
+static void process_arithmetic(struct mc_conn *c,
+                               struct token *tokens,
+                               int ntokens,
+                               bool incr)
+{
+    uint64_t delta, value;
+
+    if (ntokens < 3 || ntokens > 4 || !key_valid(&tokens[1])) {
+        OUT(c, "ERROR" CRLF);
+        return;
+    }
+
+    if (!token_to_u64(&tokens[2], &delta)) {
+        OUT(c, "CLIENT_ERROR invalid numeric delta argument" CRLF);
+        return;
+    }
+
+    bool noreply = ntokens == 4 && token_is(&tokens[3], "noreply");
+    enum mc_result result =
+        mc_incr(tokens[1].p, tokens[1].len, incr, delta, &value);
+    if (result != MC_STORED) {
+        reply(c, result, noreply);
+        return;
+    }
+
+    if (!noreply) {
+        char number[24];
+        int len = snprintf(number, sizeof(number), "%" PRIu64 CRLF, value);
+        out(c, number, len);
+    }
+}
+
+/* Parse and run one command from the input buffer.
+ * Return 1 if a command was consumed, 0 if more input is needed and -1 if
+ * the connection should be closed.
+ */
+static int process_command(struct mc_conn *c)
+{
+    if (c->swallow) {
+        size_t n = c->rlen - c->rpos;
+        if (n > c->swallow)
+            n = c->swallow;
+        c->rpos += n;
+        c->swallow -= n;
+        if (c->swallow)
+            return 0;
+    }
+
+    char *line = c->rbuf + c->rpos;
+    char *eol = memchr(line, '\n', c->rlen - c->rpos);
+    if (!eol) {
+        if (c->rlen - c->rpos > LINE_MAX_LEN) {
+            OUT(c, "CLIENT_ERROR line too long" CRLF);
+            return -1;
+        }
+        return 0;
+    }
+
+    size_t line_len = eol + 1 - line;
+    size_t len = eol - line;
+    if (len && line[len - 1] == '\r')
+        len--;
+
+    struct token tokens[MAX_TOKENS];
+    int ntokens = tokenize(line, len, tokens, MAX_TOKENS);
+    if (!ntokens) {
+        OUT(c, "ERROR" CRLF);
+        c->rpos += line_len;
+        return 1;
+    }
+
+    struct token *cmd = &tokens[0];
+    if (token_is(cmd, "get") || token_is(cmd, "gets")) {
+        char *keys = cmd->p + cmd->len;
+        process_get(c, keys, line + len - keys, cmd->len == 4);
+    } else if (token_is(cmd, "set")) {
+        return process_update(c, MC_SET, tokens, ntokens, line_len);
+    } else if (token_is(cmd, "add")) {
+        return process_update(c, MC_ADD, tokens, ntokens, line_len);
+    } else if (token_is(cmd, "replace")) {
+        return process_update(c, MC_REPLACE, tokens, ntokens, line_len);
+    } else if (token_is(cmd, "cas")) {
+        return process_update(c, MC_CAS, tokens, ntokens, line_len);
+    } else if (token_is(cmd, "delete")) {
+        /* a trailing "0" is accepted for compatibility */
+        bool noreply = token_is(&tokens[ntokens - 1], "noreply");
+        int nargs = ntokens - noreply;
+        if (nargs < 2 || nargs > 3 || !key_valid(&tokens[1]) ||
+            (nargs == 3 && !token_is(&tokens[2], "0")))
+            OUT(c, "CLIENT_ERROR bad command line format" CRLF);
+        else
+            reply(c, mc_delete(tokens[1].p, tokens[1].len), noreply);
+    } else if (token_is(cmd, "incr") || token_is(cmd, "decr")) {
+        process_arithmetic(c, tokens, ntokens, cmd->p[0] == 'i');
+    } else if (token_is(cmd, "touch")) {
+        time_t exptime;
+        if (ntokens < 3 || ntokens > 4 || !key_valid(&tokens[1]) ||
+            !token_to_exptime(&tokens[2], &exptime))
+            OUT(c, "CLIENT_ERROR bad command line format" CRLF);
+        else
+            reply(c, mc_touch(tokens[1].p, tokens[1].len, exptime),
+                  ntokens == 4 && token_is(&tokens[3], "noreply"));
+    } else if (token_is(cmd, "version")) {
+        OUT(c, "VERSION " VERSION CRLF);
+    } else if (token_is(cmd, "quit")) {
+        c->quit = true;
+    } else {
+        OUT(c, "ERROR" CRLF);
+    }
+
+    c->rpos += line_len;
+    return 1;
+}
+
+/* wait for more input, checking every second for a graceful stop */
+static int conn_read(struct mc_conn *c)
+{
+    /* keep the pending bytes at the front */
+    if (c->rpos) {
+        memmove(c->rbuf, c->rbuf + c->rpos, c->rlen - c->rpos);
+        c->rlen -= c->rpos;
+        c->rpos = 0;
+    }
+
+    /* give back the room a large value took */
+    if (!c->rlen && !c->need && c->rsize > BUFFER_SIZE) {
+        char *p = realloc(c->rbuf, BUFFER_SIZE);
+        if (p)
+            c->rbuf = p, c->rsize = BUFFER_SIZE;
+    }
+
+    size_t need = c->need > c->rlen ? c->need : c->rlen + 1;
+    if (reserve(&c->rbuf, &c->rsize, need)) {
+        ERR("no mem for memcached request");
+        return -1;
+    }
+
+    for (;;) {
+        if (g_shall_stop)
+            return -2;
+
+        int ret = wait_fd_readable(c->fd, 1000);
+        if (ret == 0)
+            break;
+        if (ret != -3)
+            return -3;
+    }
+
+    ssize_t n = recv(c->fd, c->rbuf + c->rlen, c->rsize - c->rlen, 0);
+    if (n <= 0)
+        return -4;
+
+    c->rlen += n;
+    return 0;
+}
+
+int memcached_handler(int fd, struct conn_park *park __UNUSED)
+{
+    struct mc_conn c = {
+        .fd = fd,
+        .rbuf = malloc(BUFFER_SIZE),
+        .rsize = BUFFER_SIZE,
+        .wbuf = malloc(BUFFER_SIZE),
+        .wsize = BUFFER_SIZE,
+    };
+
+    if (!c.rbuf || !c.wbuf) {
+        ERR("no mem for memcached connection");
+        goto out;
+    }
+
+    for (;;) {
+        int ret;
+        while ((ret = process_command(&c)) > 0 && !c.quit) {
+            if (c.wlen >= FLUSH_SIZE && conn_flush(&c))
+                goto out;
+        }
+
+        /* pipelined commands are answered in one go */
+        if (c.wlen && conn_flush(&c))
+            break;
+        if (ret < 0 || c.quit || conn_read(&c))
+            break;
+    }
+
+out:
+    free(c.rbuf);
+    free(c.wbuf);
+    return 0;
+}
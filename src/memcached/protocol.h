@@ -0,0 +1,6 @@
+#pragma once
+
+#include "process.h"
+
+/* Serve the memcached text protocol on connection @fd until it closes */
+int memcached_handler(int fd, struct conn_park *park);
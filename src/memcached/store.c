@@ -0,0 +1,360 @@
+#include <string.h>
+
+#include "memcached/store.h"
+#include "util/hashtable.h"
+#include "util/list.h"
+#include "util/shm.h"
+#include "util/spinlock.h"
+#include "util/system.h"
+
+#define SLAB_SIZE (1 << 20)
+#define NR_CLASSES 48
+#define CHUNK_MIN 96
+
+struct mc_item {
+    struct list_head lru;   /* most recently used first */
+    struct mc_item *h_next; /* hash chain, or free list */
+    uint64_t cas;
+    time_t exptime; /* absolute, 0 means never */
+    uint32_t flags;
+    uint32_t nbytes; /* value length */
+    uint8_t nkey;
+    uint8_t clsid;
+    char data[]; /* key followed by value */
+};
+
+struct slab_class {
+    size_t size; /* chunk size */
+    struct mc_item *free;
+    struct list_head lru;
+};
+
+struct mc_store {
+    spinlock_t lock;
+    uint64_t cas;
+
+    unsigned hash_mask;
+    struct mc_item **buckets;
+
+    char *next_slab, *end; /* memory not carved into slabs yet */
+    int nr_classes;
+    struct slab_class classes[NR_CLASSES];
+};
+
+/* mapped before fork, so the address is the same in every worker */
+static struct mc_store *store;
+
+static inline unsigned hash_key(const char *key, size_t nkey)
+{
+    unsigned hv = 0;
+
+    for (size_t i = 0; i < nkey; i++)
+        hv = HASH(hv, (unsigned char) key[i]);
+
+    return hv;
+}
+
+static inline struct mc_item **item_bucket(const char *key, size_t nkey)
+{
+    return &store->buckets[hash_key(key, nkey) & store->hash_mask];
+}
+
+static void item_unlink(struct mc_item *it)
+{
+    struct mc_item **pp = item_bucket(it->data, it->nkey);
+
+    while (*pp != it)
+        pp = &(*pp)->h_next;
+    *pp = it->h_next;
+
+    struct slab_class *c = &store->classes[it->clsid];
+    list_del(&it->lru);
+    it->h_next = c->free;
+    c->free = it;
+}
+
+static void item_link(struct mc_item *it)
+{
+    struct mc_item **pp = item_bucket(it->data, it->nkey);
+
+    it->h_next = *pp;
+    *pp = it;
+    list_add(&it->lru, &store->classes[it->clsid].lru);
+    it->cas = ++store->cas;
+}
+
+/* Return the live item of @key. An expired one is reclaimed on the way. */
+static struct mc_item *item_find(const char *key, size_t nkey)
+{
+    struct mc_item *it = *item_bucket(key, nkey);
+
+    for (; it; it = it->h_next) {
+        if (it->nkey == nkey && !memcmp(it->data, key, nkey))
+            break;
+    }
+
+    if (it && it->exptime && it->exptime <= time(NULL)) {
+        item_unlink(it);
+        return NULL;
+    }
+
+    return it;
+}
+
+static inline int class_of(size_t size)
+{
+    for (int i = 0; i < store->nr_classes; i++) {
+        if (size <= store->classes[i].size)
+            return i;
+    }
+
+    return -1;
+}
+
+static struct mc_item *item_alloc(int clsid)
+{
+    struct slab_class *c = &store->classes[clsid];
+
+    if (!c->free && store->next_slab + SLAB_SIZE <= store->end) {
+        char *slab = store->next_slab;
+        store->next_slab += SLAB_SIZE;
+
+        for (char *p = slab; p + c->size <= slab + SLAB_SIZE; p += c->size) {
+            struct mc_item *it = (struct mc_item *) p;
+            it->h_next = c->free;
+            c->free = it;
+        }
+    }
+
+    /* the class is full: evict its least recently used item */
+    if (!c->free && !list_empty(&c->lru))
+        item_unlink(list_entry(c->lru.prev, struct mc_item, lru));
+
+    struct mc_item *it = c->free;
+    if (it) {
+        c->free = it->h_next;
+        it->clsid = clsid;
+    }
+
+    return it;
+}
+
+/* Store a new item of @key in place of the current one, if any. The old
+ * item is only dropped once the new one is allocated, so it survives a
+ * failure. Allocating may evict it meanwhile, hence the second lookup.
+ */
+static struct mc_item *item_replace(const char *key,
+                                    size_t nkey,
+                                    uint32_t flags,
+                                    time_t exptime,
+                                    const char *data,
+                                    size_t nbytes,
+                                    int clsid)
+{
+    struct mc_item *it = item_alloc(clsid);
+    if (!it)
+        return NULL;
+
+    struct mc_item *old = item_find(key, nkey);
+    if (old)
+        item_unlink(old);
+
+    it->exptime = exptime;
+    it->flags = flags;
+    it->nkey = nkey;
+    it->nbytes = nbytes;
+    memcpy(it->data, key, nkey);
+    memcpy(it->data + nkey, data, nbytes);
+    item_link(it);
+
+    return it;
+}
+
+enum mc_result mc_store(enum mc_store_mode mode,
+                        const char *key,
+                        size_t nkey,
+                        uint32_t flags,
+                        time_t exptime,
+                        const char *data,
+                        size_t nbytes,
+                        uint64_t cas)
+{
+    int clsid = class_of(sizeof(struct mc_item) + nkey + nbytes);
+    if (clsid < 0)
+        return MC_TOO_LARGE;
+
+    enum mc_result result = MC_STORED;
+    spin_lock(&store->lock);
+
+    struct mc_item *old = item_find(key, nkey);
+    if ((mode == MC_ADD && old) || (mode == MC_REPLACE && !old)) {
+        result = MC_NOT_STORED;
+        goto unlock;
+    }
+
+    if (mode == MC_CAS) {
+        if (!old) {
+            result = MC_NOT_FOUND;
+            goto unlock;
+        }
+        if (old->cas != cas) {
+            result = MC_EXISTS;
+            goto unlock;
+        }
+    }
+
+    if (!item_replace(key, nkey, flags, exptime, data, nbytes, clsid))
+        result = MC_NO_MEMORY;
+
+unlock:
+    spin_unlock(&store->lock);
+    return result;
+}
+
+bool mc_get(const char *key, size_t nkey, mc_visit_t visit, void *args)
+{
+    spin_lock(&store->lock);
+
+    struct mc_item *it = item_find(key, nkey);
+    if (it) {
+        list_del(&it->lru);
+        list_add(&it->lru, &store->classes[it->clsid].lru);
+        visit(args, it->data, it->nkey, it->flags, it->data + it->nkey,
+              it->nbytes, it->cas);
+    }
+
+    spin_unlock(&store->lock);
+    return it != NULL;
+}
+
+enum mc_result mc_delete(const char *key, size_t nkey)
+{
+    spin_lock(&store->lock);
+
+    struct mc_item *it = item_find(key, nkey);
+    if (it)
+        item_unlink(it);
+
+    spin_unlock(&store->lock);
+    return it ? MC_DELETED : MC_NOT_FOUND;
+}
+
+enum mc_result mc_touch(const char *key, size_t nkey, time_t exptime)
+{
+    spin_lock(&store->lock);
+
+    struct mc_item *it = item_find(key, nkey);
+    if (it)
+        it->exptime = exptime;
+
+    spin_unlock(&store->lock);
+    return it ? MC_TOUCHED : MC_NOT_FOUND;
+}
+
+/* incr wraps around at 2^64, decr stops at 0 */
+enum mc_result mc_incr(const char *key,
+                       size_t nkey,
+                       bool incr,
+                       uint64_t delta,
+                       uint64_t *value)
+{
+    enum mc_result result = MC_STORED;
+    spin_lock(&store->lock);
+
+    struct mc_item *it = item_find(key, nkey);
+    if (!it) {
+        result = MC_NOT_FOUND;
+        goto unlock;
+    }
+
+    const char *data = it->data + it->nkey;
+    uint64_t val = 0;
+    if (!it->nbytes || it->nbytes > 20) {
+        result = MC_NON_NUMERIC;
+        goto unlock;
+    }
+
+    for (uint32_t i = 0; i < it->nbytes; i++) {
+        if (data[i] < '0' || data[i] > '9') {
+            result = MC_NON_NUMERIC;
+            goto unlock;
+        }
+        val = val * 10 + (data[i] - '0');
+    }
+
+    if (incr)
+        val += delta;
+    else
+        val = (val > delta) ? val - delta : 0;
+    *value = val;
+
+    char digits[24];
+    int len = 0;
+    do {
+        digits[sizeof(digits) - ++len] = '0' + val % 10;
+        val /= 10;
+    } while (val);
+
+    const char *number = digits + sizeof(digits) - len;
+    if ((uint32_t) len == it->nbytes) { /* rewrite in place */
+        memcpy(it->data + it->nkey, number, len);
+        it->cas = ++store->cas;
+        goto unlock;
+    }
+
+    int clsid = class_of(sizeof(struct mc_item) + nkey + len);
+    if (!item_replace(key, nkey, it->flags, it->exptime, number, len, clsid))
+        result = MC_NO_MEMORY;
+
+unlock:
+    spin_unlock(&store->lock);
+    return result;
+}
+
+size_t mc_value_max()
+{
+    return SLAB_SIZE - sizeof(struct mc_item) - MC_KEY_MAX;
+}
+
+/* Called by master before forking workers */
+int mc_store_init(size_t mbytes)
+{
+    size_t page_size = get_page_size();
+    size_t size = mbytes << 20;
+
+    unsigned buckets = 1024; /* about one bucket per KiB */
+    while (buckets < size >> 10)
+        buckets <<= 1;
+
+    size_t header = ALIGN(sizeof(struct mc_store) +
+                              buckets * sizeof(struct mc_item *),
+                          page_size);
+    char *addr = shm_pages_alloc((header + size) / page_size);
+    if (!addr)
+        return -1;
+
+    /* shared anonymous pages are zeroed: hash buckets start empty */
+    store = (struct mc_store *) addr;
+    spin_lock_init(&store->lock);
+    store->cas = 0;
+    store->hash_mask = buckets - 1;
+    store->buckets = (struct mc_item **) (addr + sizeof(struct mc_store));
+    store->next_slab = addr + header;
+    store->end = addr + header + size;
+
+    size_t chunk = CHUNK_MIN;
+    int i = 0;
+    for (; i < NR_CLASSES - 1 && chunk < SLAB_SIZE / 2; i++) {
+        store->classes[i].size = chunk;
+        chunk = ALIGN(chunk * 5 / 4, MEM_ALIGN);
+    }
+    store->classes[i++].size = SLAB_SIZE;
+    store->nr_classes = i;
+
+    for (i = 0; i < store->nr_classes; i++) {
+        store->classes[i].free = NULL;
+        INIT_LIST_HEAD(&store->classes[i].lru);
+    }
+
+    return 0;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+/* Key-value store shared by all worker processes.
+ *
+ * Items live in shared memory mapped by the master before forking, so every
+ * worker sees the same cache at the same address. Memory is carved into 1 MiB
+ * slabs of fixed-size chunks; each size class keeps a free list and an LRU
+ * list, and a full class evicts its least recently used item. All accesses
+ * are serialized by one spinlock and never yield while holding it.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define MC_KEY_MAX 250
+
+enum mc_store_mode { MC_SET = 0, MC_ADD, MC_REPLACE, MC_CAS };
+
+enum mc_result {
+    MC_STORED = 0,
+    MC_NOT_STORED,
+    MC_EXISTS,
+    MC_NOT_FOUND,
+    MC_DELETED,
+    MC_TOUCHED,
+    MC_NON_NUMERIC,
+    MC_TOO_LARGE,
+    MC_NO_MEMORY,
+};
+
+/* invoked with the store locked, must not yield */
+typedef void (*mc_visit_t)(void *args,
+                           const char *key,
+                           size_t nkey,
+                           uint32_t flags,
+                           const char *data,
+                           size_t nbytes,
+                           uint64_t cas);
+
+/* @exptime is absolute, 0 means never expire */
+enum mc_result mc_store(enum mc_store_mode mode,
+                        const char *key,
+                        size_t nkey,
+                        uint32_t flags,
+                        time_t exptime,
+                        const char *data,
+                        size_t nbytes,
+                        uint64_t cas);
+bool mc_get(const char *key, size_t nkey, mc_visit_t visit, void *args);
+enum mc_result mc_delete(const char *key, size_t nkey);
+enum mc_result mc_touch(const char *key, size_t nkey, time_t exptime);
+enum mc_result mc_incr(const char *key,
+                       size_t nkey,
+                       bool incr,
+                       uint64_t delta,
+                       uint64_t *value);
+
+size_t mc_value_max();
+int mc_store_init(size_t mbytes);
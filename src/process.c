@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <errno.h>
 #include <netinet/in.h>
 #include <stdbool.h>
@@ -12,10 +13,15 @@
 #include "event.h"
 #include "logger.h"
 #include "process.h"
+#include "syscall_hook.h"
+#include "thread_pool.h"
+#include "uring.h"
 #include "util/net.h"
+#include "util/memcache.h"
 #include "util/shm.h"
 #include "util/spinlock.h"
 #include "util/system.h"
+#include "util/timer_wheel.h"
 
 #define INVALID_PID -1 /* non-existing process ID */
 
@@ -24,27 +30,52 @@ struct process {
     int cpuid; /* bounded cpu ID */
 };
 
-static inline void request_default_handler(int fd __UNUSED) {}
+#define MAX_SERVICES 8
 
-static master_init_proc_t master_init_proc = NULL;
-static worker_init_proc_t worker_init_proc = NULL;
-static request_handler_t request_handler = request_default_handler;
+/* a protocol served on its own listen socket */
+struct service {
+    const char *listen_conf; /* configuration entry of the listen address */
+    master_init_proc_t master_init;
+    worker_init_proc_t worker_init;
+    request_handler_t handler;
 
-static int listen_fd;
-static spinlock_t *accept_lock; /* lock for accept fd */
+    char *addr;
+    int port;
+    int listen_fd;
+    spinlock_t *accept_lock; /* lock for accept fd */
+};
+
+static struct service services[MAX_SERVICES];
+static int nr_services = 0;
+
+struct connection {
+    int fd;
+    struct service *service;
+
+    struct conn_park park;
+    struct list_head parked;  /* in parked_conns while parked */
+    struct wheel_timer timer; /* closes the parked connection */
+};
+
+static struct memcache *connection_cache;
+
+static struct list_head parked_conns;
+static struct timer_wheel park_timers;
 
 static struct process worker[MAX_WORKER_PROCESS];
 static int mastr_pid;
 static int worker_pid; /* master pid included */
 enum proc_type g_process_type;
 
-static int connection_count = 1;      /* if 0, worker exits. */
+static int connection_count = 0;      /* if 0, worker exits. */
 static bool all_workers_exit = false; /* whether if all worker exist. */
 static bool shall_create_worker = true;
 
 int g_shall_stop = 0; /* shall we stop the service? if 0, continue */
 int g_shall_exit = 0; /* shall we force quit the service? */
 
+static int create_tcp_server(const char *ip, int port);
+
 static int worker_empty()
 {
     for (int i = 0; i < g_worker_processes; i++) {
@@ -111,45 +142,188 @@ static inline void decrease_conn_and_check()
         exit(0);
 }
 
-static void handle_connection(void *args)
+static void close_connection(struct connection *conn)
 {
-    int connfd = (int) (intptr_t) args;
+    int connfd = conn->fd;
 
-    request_handler(connfd);
+    memcache_free(connection_cache, conn);
+    if (g_edge_triggered)
+        unregister_fd_event(connfd);
     close(connfd);
     decrease_conn_and_check();
 }
 
+static void handle_connection(void *args);
+
+static void unpark_connection(struct connection *conn)
+{
+    if (is_fd_event_registered(conn->fd))
+        unpark_fd_event(conn->fd, EVENT_READABLE);
+    else
+        del_fd_event(conn->fd, EVENT_READABLE);
+
+    list_del(&conn->parked);
+    if (wheel_timer_pending(&conn->timer))
+        timer_wheel_del(&park_timers, &conn->timer);
+}
+
+/* Runs in the scheduler: bytes or EOF arrived on a parked connection */
+static void parked_conn_callback(void *args)
+{
+    struct connection *conn = args;
+
+    unpark_connection(conn);
+    if (dispatch_coro(handle_connection, conn)) {
+        WARN("system busy to resume connection.");
+        close_connection(conn);
+    }
+}
+
+static void parked_conn_expire(struct wheel_timer *timer)
+{
+    struct connection *conn = container_of(timer, struct connection, timer);
+
+    unpark_connection(conn);
+    close_connection(conn);
+}
+
+/* Return 0 if parked, 1 if bytes or EOF are pending already and -1 if the
+ * connection cannot be parked.
+ */
+static int park_connection(struct connection *conn)
+{
+    int connfd = conn->fd;
+    char c;
+
+    if (g_shall_stop || conn->park.timeout <= 0)
+        return -1;
+
+    /* readiness is only reported for bytes arriving from now on */
+    if (real_sys_recv(connfd, &c, 1, MSG_PEEK | MSG_DONTWAIT) >= 0)
+        return 1;
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+        return -1;
+
+    if (is_fd_event_registered(connfd))
+        park_fd_event(connfd, EVENT_READABLE, parked_conn_callback, conn);
+    else if (add_fd_event(connfd, EVENT_READABLE, parked_conn_callback, conn))
+        return -1;
+
+    list_add_tail(&conn->parked, &parked_conns);
+    wheel_timer_init(&conn->timer);
+    conn->timer.expires = get_curr_mseconds() + conn->park.timeout;
+    timer_wheel_add(&park_timers, &conn->timer);
+
+    return 0;
+}
+
+static void handle_connection(void *args)
+{
+    struct connection *conn = args;
+
+    while (conn->service->handler(conn->fd, &conn->park)) {
+        int ret = park_connection(conn);
+        if (ret == 0) /* the coroutine is free to serve others */
+            return;
+        if (ret < 0)
+            break;
+    }
+
+    close_connection(conn);
+}
+
 static inline int worker_can_accept()
 {
     return connection_count < g_worker_connections;
 }
 
-static int worker_accept()
+/* Connections are accepted with accept4(SOCK_NONBLOCK). The remaining socket
+ * options are inherited from the listen socket, see create_tcp_server().
+ */
+static int worker_accept(struct service *s)
 {
-    struct sockaddr addr;
-    socklen_t addrlen;
     int connfd;
 
+    /* The kernel distributes connections among SO_REUSEPORT sockets, so
+     * there is no need to take turns on the shared accept lock.
+     */
+    if (g_reuse_port) {
+        if (!worker_can_accept())
+            return 0;
+
+        return accept4(s->listen_fd, NULL, NULL, SOCK_NONBLOCK);
+    }
+
     if (likely(g_worker_processes > 1)) {
-        if (worker_can_accept() && spin_trylock(accept_lock)) {
-            connfd = accept(listen_fd, &addr, &addrlen);
-            spin_unlock(accept_lock);
+        if (worker_can_accept() && spin_trylock(s->accept_lock)) {
+            connfd = accept4(s->listen_fd, NULL, NULL, SOCK_NONBLOCK);
+            spin_unlock(s->accept_lock);
             return connfd;
         }
 
         return 0;
     } else
-        connfd = accept(listen_fd, &addr, &addrlen);
+        connfd = accept4(s->listen_fd, NULL, NULL, SOCK_NONBLOCK);
 
     return connfd;
 }
 
-static void worker_accept_cycle(void *args __UNUSED)
+static void worker_dispatch(struct service *s, int connfd)
 {
+    if (g_edge_triggered && register_fd_event(connfd)) {
+        ERR("Failed to register connection fd:%d, %s", connfd,
+            strerror(errno));
+        close(connfd);
+        return;
+    }
+
+    struct connection *conn = memcache_alloc(connection_cache);
+    if (conn) {
+        conn->fd = connfd;
+        conn->service = s;
+        conn->park.data = 0;
+    }
+
+    if (!conn || dispatch_coro(handle_connection, conn)) {
+        WARN("system busy to handle request.");
+        if (conn)
+            memcache_free(connection_cache, conn);
+        if (g_edge_triggered)
+            unregister_fd_event(connfd);
+        close(connfd);
+        return;
+    }
+    increase_conn();
+}
+
+/* Drain the backlog without yielding once the listen socket is readable */
+static void worker_accept_batch(struct service *s)
+{
+    for (int i = 1; i < g_accept_batch && worker_can_accept(); i++) {
+        int connfd;
+        if (uring_enabled())
+            connfd = uring_try_accept(s->listen_fd);
+        else
+            connfd =
+                real_sys_accept4(s->listen_fd, NULL, NULL, SOCK_NONBLOCK);
+        if (connfd < 0)
+            break;
+
+        worker_dispatch(s, connfd);
+    }
+}
+
+/* one per service, each counts as a connection until the worker stops */
+static void worker_accept_cycle(void *args)
+{
+    struct service *s = args;
+
     for (;;) {
         if (unlikely(g_shall_stop)) {
             set_proc_title("cserv: worker process is shutting down");
+            /* stop the kernel from queueing connections to this worker */
+            if (g_reuse_port)
+                close(s->listen_fd);
             decrease_conn_and_check();
             break;
         }
@@ -157,14 +331,10 @@ static void worker_accept_cycle(void *args __UNUSED)
         if (unlikely(g_shall_exit))
             exit(0);
 
-        int connfd = worker_accept();
+        int connfd = worker_accept(s);
         if (likely(connfd > 0)) {
-            if (dispatch_coro(handle_connection, (void *) (intptr_t) connfd)) {
-                WARN("system busy to handle request.");
-                close(connfd);
-                continue;
-            }
-            increase_conn();
+            worker_dispatch(s, connfd);
+            worker_accept_batch(s);
         } else if (connfd == 0) {
             schedule_timeout(200);
             continue;
@@ -172,16 +342,74 @@ static void worker_accept_cycle(void *args __UNUSED)
     }
 }
 
+/* Closes parked connections when their timeout passes, and all of them once
+ * the worker stops. Counts as a connection until then.
+ */
+static void worker_park_cycle(void *args __UNUSED)
+{
+    while (!g_shall_stop) {
+        long long now = get_curr_mseconds();
+        timer_wheel_advance(&park_timers, now, parked_conn_expire);
+
+        /* wake up every second at least to notice a graceful stop */
+        long long next = timer_wheel_next(&park_timers);
+        long long timeout = (next < 0) ? 1000 : next - now;
+        schedule_timeout(timeout > 1000 ? 1000 : timeout);
+    }
+
+    while (!list_empty(&parked_conns)) {
+        struct connection *conn =
+            list_first_entry(&parked_conns, struct connection, parked);
+        unpark_connection(conn);
+        close_connection(conn);
+    }
+    decrease_conn_and_check();
+}
+
 void worker_process_cycle()
 {
-    if (worker_init_proc && worker_init_proc()) {
-        ERR("Failed to initialize worker process");
+    for (int i = 0; i < nr_services; i++) {
+        struct service *s = &services[i];
+        if (s->worker_init && s->worker_init()) {
+            ERR("Failed to initialize worker process");
+            exit(0);
+        }
+
+        if (g_reuse_port)
+            s->listen_fd = create_tcp_server(s->addr, s->port);
+    }
+
+    connection_cache =
+        memcache_create(sizeof(struct connection), g_worker_connections);
+    if (!connection_cache) {
+        ERR("Failed to create memcache for connections");
         exit(0);
     }
 
-    schedule_init(g_coro_stack_kbytes, g_worker_connections);
+    schedule_init(g_coro_stack_kbytes, g_worker_connections,
+                  g_coro_shared_stack);
     event_loop_init(g_worker_connections);
-    dispatch_coro(worker_accept_cycle, NULL);
+    if (g_io_uring) {
+        uring_init(g_worker_connections);
+        set_sched_policy(uring_cycle);
+    }
+    thread_pool_init(g_file_io_threads);
+
+    INIT_LIST_HEAD(&parked_conns);
+    timer_wheel_init(&park_timers, get_curr_mseconds());
+    dispatch_coro(worker_park_cycle, NULL);
+    connection_count++;
+
+    for (int i = 0; i < nr_services; i++) {
+        struct service *s = &services[i];
+        if (g_edge_triggered && register_fd_event(s->listen_fd)) {
+            ERR("Failed to register listen fd: %s", strerror(errno));
+            exit(0);
+        }
+
+        dispatch_coro(worker_accept_cycle, s);
+        connection_count++;
+    }
     INFO("worker success running...");
     schedule_cycle();
 }
@@ -199,9 +427,12 @@ static void send_signal_to_workers(int signo)
 
 void master_process_cycle()
 {
-    if (master_init_proc && master_init_proc()) {
-        ERR("Failed to init master process, cserv exit");
-        exit(0);
+    for (int i = 0; i < nr_services; i++) {
+        struct service *s = &services[i];
+        if (s->master_init && s->master_init()) {
+            ERR("Failed to init master process, cserv exit");
+            exit(0);
+        }
     }
 
     INFO("master success running...");
@@ -256,13 +487,26 @@ void worker_exit_handler(int pid)
         all_workers_exit = true;
 }
 
-void register_service(master_init_proc_t master_proc,
+/* @listen_conf names the configuration entry of the listen address. A
+ * service whose entry is "off" is not started.
+ */
+void register_service(const char *listen_conf,
+                      master_init_proc_t master_proc,
                       worker_init_proc_t worker_proc,
                       request_handler_t handler)
 {
-    master_init_proc = master_proc;
-    worker_init_proc = worker_proc;
-    request_handler = handler;
+    if (nr_services == MAX_SERVICES) {
+        printf("Too many services, at most %d\n", MAX_SERVICES);
+        exit(0);
+    }
+
+    struct service *s = &services[nr_services++];
+    s->listen_conf = listen_conf;
+    s->master_init = master_proc;
+    s->worker_init = worker_proc;
+    s->handler = handler;
+    s->listen_fd = -1;
+    s->accept_lock = NULL;
 }
 
 static int create_tcp_server(const char *ip, int port)
@@ -278,6 +522,18 @@ static int create_tcp_server(const char *ip, int port)
         exit(0);
     }
 
+    if (g_reuse_port && set_reuse_port(listenfd)) {
+        printf("Failed to set SO_REUSEPORT on listen socket: %s\n",
+               strerror(errno));
+        exit(0);
+    }
+
+    /* inherited by the accepted connections */
+    if (enable_tcp_no_delay(listenfd) || set_keep_alive(listenfd, KEEP_ALIVE)) {
+        printf("Failed to set listen socket options: %s\n", strerror(errno));
+        exit(0);
+    }
+
     if (set_nonblock(listenfd)) {
         printf("Failed to set listen socket non-bloacking: %s\n",
                strerror(errno));
@@ -305,12 +561,37 @@ static int create_tcp_server(const char *ip, int port)
 
 void tcp_srv_init()
 {
-    listen_fd = create_tcp_server(g_server_addr, g_server_port);
-    accept_lock = shm_alloc(sizeof(spinlock_t));
-    if (!accept_lock) {
-        printf("Failed to allocate global accept lock\n");
-        exit(0);
+    int enabled = 0;
+
+    for (int i = 0; i < nr_services; i++) {
+        struct service *s = &services[i];
+        if (get_listen_conf(s->listen_conf, &s->addr, &s->port))
+            continue; /* off */
+
+        s->listen_fd = create_tcp_server(s->addr, s->port);
+        services[enabled++] = *s;
+        s = &services[enabled - 1];
+
+        /* Each worker creates its own listen socket after fork. The socket
+         * of master only validates the address and must not join the
+         * reuseport group, or the kernel would queue connections nobody
+         * accepts.
+         */
+        if (g_reuse_port) {
+            close(s->listen_fd);
+            s->listen_fd = -1;
+            continue;
+        }
+
+        s->accept_lock = shm_alloc(sizeof(spinlock_t));
+        if (!s->accept_lock) {
+            printf("Failed to allocate global accept lock\n");
+            exit(0);
+        }
+        spin_lock_init(s->accept_lock);
     }
+
+    nr_services = enabled;
 }
 
 void process_init()
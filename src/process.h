@@ -15,9 +15,22 @@ extern int g_shall_stop, g_shall_exit;
 
 typedef int (*master_init_proc_t)();
 typedef int (*worker_init_proc_t)();
-typedef void (*request_handler_t)(int fd);
+/* An idle connection handed back by its handler. It keeps no coroutine, only
+ * its fd watched by the event loop, until bytes arrive or @timeout passes.
+ */
+struct conn_park {
+    int timeout;        /* in milliseconds */
+    unsigned long data; /* kept for the handler resuming the connection */
+};
+
+/* Serve connection @fd. @park->data is 0 for a new connection, or what the
+ * handler stored before parking it. Return 1 to park the connection with
+ * @park filled in, 0 to close it.
+ */
+typedef int (*request_handler_t)(int fd, struct conn_park *park);
 
-void register_service(master_init_proc_t master_proc,
+void register_service(const char *listen_conf,
+                      master_init_proc_t master_proc,
                       worker_init_proc_t worker_proc,
                       request_handler_t handler);
 
@@ -1,37 +1,61 @@
 #define _GNU_SOURCE
 #include <dlfcn.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/uio.h>
 #include <unistd.h>
 
 #include "coro/sched.h"
+#include "env.h"
 #include "event.h"
 #include "syscall_hook.h"
+#include "thread_pool.h"
+#include "uring.h"
 #include "util/net.h"
+#include "util/system.h"
 
 #define HOOK_SYSCALL(name) \
     real_sys_##name = (sys_##name) dlsym(RTLD_NEXT, #name)
 
-#define CONN_TIMEOUT (10 * 1000)
-#define ACCEPT_TIMEOUT (3 * 1000)
-
-#define READ_TIMEOUT (10 * 1000)
-#define RECV_TIMEOUT (10 * 1000)
-
-#define WRITE_TIMEOUT (10 * 1000)
-#define SEND_TIMEOUT (10 * 1000)
-
-#define KEEP_ALIVE 60
-
 static sys_connect real_sys_connect = NULL;
 static sys_accept real_sys_accept = NULL;
+sys_accept4 real_sys_accept4 = NULL;
 
 static sys_read real_sys_read = NULL;
-static sys_recv real_sys_recv = NULL;
+sys_recv real_sys_recv = NULL;
+static sys_readv real_sys_readv = NULL;
+static sys_recvmsg real_sys_recvmsg = NULL;
 
 sys_write real_sys_write = NULL;
 static sys_send real_sys_send = NULL;
+static sys_writev real_sys_writev = NULL;
+static sys_sendmsg real_sys_sendmsg = NULL;
+
+static sys_sendfile real_sys_sendfile = NULL;
+static sys_splice real_sys_splice = NULL;
+
+static sys_sleep real_sys_sleep = NULL;
+static sys_usleep real_sys_usleep = NULL;
+static sys_nanosleep real_sys_nanosleep = NULL;
+static sys_poll real_sys_poll = NULL;
+static sys_select real_sys_select = NULL;
+
+static sys_open real_sys_open = NULL;
+static sys_openat real_sys_openat = NULL;
+static sys_stat real_sys_stat = NULL;
+static sys_pread real_sys_pread = NULL;
+static sys_close real_sys_close = NULL;
+
+/* waits without timeout are re-armed at this interval */
+#define WAIT_SLICE (60 * 1000)
 
 #define fd_not_ready() ((EAGAIN == errno) || (EWOULDBLOCK == errno))
 
@@ -45,30 +69,91 @@ static void event_conn_callback(void *args)
     wakeup_coro_priority(args);
 }
 
+/* Park the current coroutine until @fd is ready for @what, at most @timeout
+ * and never past the coroutine's deadline.
+ * Return 0 if ready, -2 if the fd can not be watched, -3 on timeout.
+ */
+static int wait_fd_event(int fd, event_t what, event_proc_t proc, int timeout)
+{
+    if ((timeout = coro_timeout(timeout)) < 0) {
+        errno = ETIME;
+        return -3;
+    }
+
+    if (uring_enabled()) {
+        if (uring_poll(fd, what, timeout))
+            return (errno == ETIME) ? -3 : -2;
+        return 0;
+    }
+
+    if (is_fd_event_registered(fd)) {
+        park_fd_event(fd, what, proc, current_coro());
+        schedule_timeout(timeout);
+        unpark_fd_event(fd, what);
+    } else {
+        if (add_fd_event(fd, what, proc, current_coro()))
+            return -2;
+
+        schedule_timeout(timeout);
+        del_fd_event(fd, what);
+    }
+
+    if (is_wakeup_by_timeout()) {
+        errno = ETIME;
+        return -3;
+    }
+
+    return 0;
+}
+
+int wait_fd_readable(int fd, int milliseconds)
+{
+    /* The caller may not have drained the socket, while waiting assumes its
+     * readiness was consumed. Data or EOF already pending returns at once.
+     */
+    char c;
+    if (real_sys_recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) >= 0 ||
+        !fd_not_ready())
+        return 0;
+
+    return wait_fd_event(fd, EVENT_READABLE, event_rw_callback, milliseconds);
+}
+
+int wait_fd_writable(int fd, int milliseconds)
+{
+    return wait_fd_event(fd, EVENT_WRITABLE, event_rw_callback, milliseconds);
+}
+
 int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen)
 {
     set_nonblock(sockfd);
 
-    int ret = real_sys_connect(sockfd, addr, addrlen);
+    int ret;
+    if (uring_enabled())
+        ret = uring_connect(sockfd, addr, addrlen, g_connect_timeout);
+    else
+        ret = real_sys_connect(sockfd, addr, addrlen);
     if (0 == ret) /* successful */
         return 0;
 
-    if (ret < 0 && errno != EINPROGRESS)
-        return -1;
-
-    if (add_fd_event(sockfd, EVENT_WRITABLE, event_conn_callback,
-                     current_coro()))
-        return -2;
+    if (ret < 0 && errno != EINPROGRESS) {
+        if (ETIME != errno)
+            return -1;
 
-    schedule_timeout(CONN_TIMEOUT);
-    del_fd_event(sockfd, EVENT_WRITABLE);
-    if (is_wakeup_by_timeout()) {
         errno = ETIMEDOUT;
         return -3;
     }
 
+    ret = wait_fd_event(sockfd, EVENT_WRITABLE, event_conn_callback,
+                        g_connect_timeout);
+    if (ret) {
+        if (ret == -3)
+            errno = ETIMEDOUT;
+        return ret;
+    }
+
     int flags;
-    socklen_t len;
+    socklen_t len = sizeof(flags);
     ret = getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &flags, &len);
     if (ret == -1 || flags || !len) {
         if (flags)
@@ -84,22 +169,22 @@ int accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen)
 {
     int connfd = 0;
 
-    while ((connfd = real_sys_accept(sockfd, addr, addrlen)) < 0) {
-        if (EINTR == errno)
-            continue;
-
-        if (!fd_not_ready())
-            return -1;
-
-        if (add_fd_event(sockfd, EVENT_READABLE, event_conn_callback,
-                         current_coro()))
-            return -2;
-
-        schedule_timeout(ACCEPT_TIMEOUT);
-        del_fd_event(sockfd, EVENT_READABLE);
-        if (is_wakeup_by_timeout()) {
-            errno = ETIME;
-            return -3;
+    if (uring_enabled()) {
+        connfd = uring_accept(sockfd, addr, addrlen, 0, g_accept_timeout);
+        if (connfd < 0)
+            return (ETIME == errno) ? -3 : -1;
+    } else {
+        while ((connfd = real_sys_accept(sockfd, addr, addrlen)) < 0) {
+            if (EINTR == errno)
+                continue;
+
+            if (!fd_not_ready())
+                return -1;
+
+            int ret = wait_fd_event(sockfd, EVENT_READABLE,
+                                    event_conn_callback, g_accept_timeout);
+            if (ret)
+                return ret;
         }
     }
 
@@ -121,10 +206,220 @@ int accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen)
     return connfd;
 }
 
+/* Unlike accept(), the connection is returned as is: Linux copies TCP_NODELAY
+ * and the keep-alive settings from the listen socket, and only the
+ * non-blocking flag has to be requested through @flags.
+ */
+int accept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags)
+{
+    int connfd;
+
+    if (uring_enabled()) {
+        connfd = uring_accept(sockfd, addr, addrlen, flags, g_accept_timeout);
+        if (connfd < 0)
+            return (ETIME == errno) ? -3 : -1;
+        return connfd;
+    }
+
+    while ((connfd = real_sys_accept4(sockfd, addr, addrlen,
+                                      flags | SOCK_NONBLOCK)) < 0) {
+        if (EINTR == errno)
+            continue;
+
+        if (!fd_not_ready())
+            return -1;
+
+        int ret = wait_fd_event(sockfd, EVENT_READABLE, event_conn_callback,
+                                g_accept_timeout);
+        if (ret)
+            return ret;
+    }
+
+    return connfd;
+}
+
+/* Files are always "ready" for the event loop, yet reading them may wait for
+ * the disk. Blocking file calls made by coroutines run on the thread pool.
+ */
+enum file_op { FILE_OPENAT, FILE_STAT, FILE_READ, FILE_PREAD };
+
+struct file_call {
+    enum file_op op;
+    int fd;
+    const char *path;
+    int flags;
+    mode_t mode;
+    void *buf;
+    size_t count;
+    off_t offset;
+    long ret;
+    int err;
+};
+
+/* fds opened in blocking mode, indexed by fd, whose reads are offloaded */
+static unsigned char *file_fds;
+static int nr_file_fds;
+
+static void file_call_task(void *args)
+{
+    struct file_call *c = args;
+
+    switch (c->op) {
+    case FILE_OPENAT:
+        c->ret = real_sys_openat(c->fd, c->path, c->flags, c->mode);
+        break;
+    case FILE_STAT:
+        c->ret = real_sys_stat(c->path, c->buf);
+        break;
+    case FILE_READ:
+        c->ret = real_sys_read(c->fd, c->buf, c->count);
+        break;
+    case FILE_PREAD:
+        c->ret = real_sys_pread(c->fd, c->buf, c->count, c->offset);
+        break;
+    }
+    c->err = errno;
+}
+
+/* Return false if @c has to be run inline, outside coroutines for example */
+static bool offload_file_call(struct file_call *c)
+{
+    if (!in_coroutine() || thread_pool_run(file_call_task, c))
+        return false;
+
+    if (c->ret < 0)
+        errno = c->err;
+    return true;
+}
+
+static inline bool is_file_fd(int fd)
+{
+    return fd >= 0 && fd < nr_file_fds && file_fds[fd];
+}
+
+static void mark_file_fd(int fd)
+{
+    if (fd >= nr_file_fds) {
+        int n = nr_file_fds ? nr_file_fds : 1024;
+        while (n <= fd)
+            n <<= 1;
+
+        unsigned char *p = realloc(file_fds, n);
+        if (!p)
+            return;
+        memset(p + nr_file_fds, 0, n - nr_file_fds);
+        file_fds = p;
+        nr_file_fds = n;
+    }
+
+    file_fds[fd] = 1;
+}
+
+static int file_open(int dirfd, const char *path, int flags, mode_t mode)
+{
+    struct file_call c = {
+        .op = FILE_OPENAT,
+        .fd = dirfd,
+        .path = path,
+        .flags = flags,
+        .mode = mode,
+    };
+
+    if (!offload_file_call(&c))
+        c.ret = real_sys_openat(dirfd, path, flags, mode);
+
+    if (c.ret >= 0 && thread_pool_enabled() &&
+        !(flags & (O_NONBLOCK | O_PATH)))
+        mark_file_fd(c.ret);
+
+    return c.ret;
+}
+
+static inline mode_t open_mode(int flags, va_list ap)
+{
+    if ((flags & O_CREAT) || (flags & O_TMPFILE) == O_TMPFILE)
+        return va_arg(ap, mode_t);
+
+    return 0;
+}
+
+int open(const char *pathname, int flags, ...)
+{
+    va_list ap;
+
+    va_start(ap, flags);
+    mode_t mode = open_mode(flags, ap);
+    va_end(ap);
+
+    return file_open(AT_FDCWD, pathname, flags, mode);
+}
+
+int openat(int dirfd, const char *pathname, int flags, ...)
+{
+    va_list ap;
+
+    va_start(ap, flags);
+    mode_t mode = open_mode(flags, ap);
+    va_end(ap);
+
+    return file_open(dirfd, pathname, flags, mode);
+}
+
+int stat(const char *pathname, struct stat *statbuf)
+{
+    struct file_call c = {.op = FILE_STAT, .path = pathname, .buf = statbuf};
+
+    if (offload_file_call(&c))
+        return c.ret;
+
+    return real_sys_stat(pathname, statbuf);
+}
+
+ssize_t pread(int fd, void *buf, size_t count, off_t offset)
+{
+    struct file_call c = {
+        .op = FILE_PREAD,
+        .fd = fd,
+        .buf = buf,
+        .count = count,
+        .offset = offset,
+    };
+
+    if (is_file_fd(fd) && offload_file_call(&c))
+        return c.ret;
+
+    return real_sys_pread(fd, buf, count, offset);
+}
+
+int close(int fd)
+{
+    if (is_file_fd(fd))
+        file_fds[fd] = 0;
+
+    return real_sys_close(fd);
+}
+
 ssize_t read(int fd, void *buf, size_t count)
 {
     ssize_t n;
 
+    if (is_file_fd(fd)) {
+        struct file_call c = {
+            .op = FILE_READ,
+            .fd = fd,
+            .buf = buf,
+            .count = count,
+        };
+
+        if (offload_file_call(&c)) {
+            if (c.ret >= 0 || !fd_not_ready())
+                return c.ret;
+
+            /* the fd was closed behind our back and reused by a socket */
+            file_fds[fd] = 0;
+        }
+    }
+
     while ((n = real_sys_read(fd, buf, count)) < 0) {
         if (EINTR == errno)
             continue;
@@ -132,15 +427,10 @@ ssize_t read(int fd, void *buf, size_t count)
         if (!fd_not_ready())
             return -1;
 
-        if (add_fd_event(fd, EVENT_READABLE, event_rw_callback, current_coro()))
-            return -2;
-
-        schedule_timeout(READ_TIMEOUT);
-        del_fd_event(fd, EVENT_READABLE);
-        if (is_wakeup_by_timeout()) {
-            errno = ETIME;
-            return -3;
-        }
+        int ret = wait_fd_event(fd, EVENT_READABLE, event_rw_callback,
+                                g_read_timeout);
+        if (ret)
+            return ret;
     }
 
     return n;
@@ -150,6 +440,13 @@ ssize_t recv(int sockfd, void *buf, size_t len, int flags)
 {
     ssize_t n;
 
+    if (uring_enabled()) {
+        n = uring_recv(sockfd, buf, len, flags, g_read_timeout);
+        if (n < 0 && ETIME == errno)
+            return -3;
+        return n;
+    }
+
     while ((n = real_sys_recv(sockfd, buf, len, flags)) < 0) {
         if (EINTR == errno)
             continue;
@@ -157,16 +454,57 @@ ssize_t recv(int sockfd, void *buf, size_t len, int flags)
         if (!fd_not_ready())
             return -1;
 
-        if (add_fd_event(sockfd, EVENT_READABLE, event_rw_callback,
-                         current_coro()))
-            return -2;
+        int ret = wait_fd_event(sockfd, EVENT_READABLE, event_rw_callback,
+                                g_read_timeout);
+        if (ret)
+            return ret;
+    }
+
+    return n;
+}
+
+ssize_t readv(int fd, const struct iovec *iov, int iovcnt)
+{
+    ssize_t n;
+
+    while ((n = real_sys_readv(fd, iov, iovcnt)) < 0) {
+        if (EINTR == errno)
+            continue;
+
+        if (!fd_not_ready())
+            return -1;
+
+        int ret = wait_fd_event(fd, EVENT_READABLE, event_rw_callback,
+                                g_read_timeout);
+        if (ret)
+            return ret;
+    }
+
+    return n;
+}
+
+ssize_t recvmsg(int sockfd, struct msghdr *msg, int flags)
+{
+    ssize_t n;
 
-        schedule_timeout(RECV_TIMEOUT);
-        del_fd_event(sockfd, EVENT_READABLE);
-        if (is_wakeup_by_timeout()) {
-            errno = ETIME;
+    if (uring_enabled()) {
+        n = uring_recvmsg(sockfd, msg, flags, g_read_timeout);
+        if (n < 0 && ETIME == errno)
             return -3;
-        }
+        return n;
+    }
+
+    while ((n = real_sys_recvmsg(sockfd, msg, flags)) < 0) {
+        if (EINTR == errno)
+            continue;
+
+        if (!fd_not_ready())
+            return -1;
+
+        int ret = wait_fd_event(sockfd, EVENT_READABLE, event_rw_callback,
+                                g_read_timeout);
+        if (ret)
+            return ret;
     }
 
     return n;
@@ -183,15 +521,10 @@ ssize_t write(int fd, const void *buf, size_t count)
         if (!fd_not_ready())
             return -1;
 
-        if (add_fd_event(fd, EVENT_WRITABLE, event_rw_callback, current_coro()))
-            return -2;
-
-        schedule_timeout(WRITE_TIMEOUT);
-        del_fd_event(fd, EVENT_WRITABLE);
-        if (is_wakeup_by_timeout()) {
-            errno = ETIME;
-            return -3;
-        }
+        int ret = wait_fd_event(fd, EVENT_WRITABLE, event_rw_callback,
+                                g_write_timeout);
+        if (ret)
+            return ret;
     }
 
     return n;
@@ -201,6 +534,13 @@ ssize_t send(int sockfd, const void *buf, size_t len, int flags)
 {
     ssize_t n;
 
+    if (uring_enabled()) {
+        n = uring_send(sockfd, buf, len, flags, g_write_timeout);
+        if (n < 0 && ETIME == errno)
+            return -3;
+        return n;
+    }
+
     while ((n = real_sys_send(sockfd, buf, len, flags)) < 0) {
         if (EINTR == errno)
             continue;
@@ -208,16 +548,405 @@ ssize_t send(int sockfd, const void *buf, size_t len, int flags)
         if (!fd_not_ready())
             return -1;
 
-        if (add_fd_event(sockfd, EVENT_WRITABLE, event_rw_callback,
-                         current_coro()))
-            return -2;
+        int ret = wait_fd_event(sockfd, EVENT_WRITABLE, event_rw_callback,
+                                g_write_timeout);
+        if (ret)
+            return ret;
+    }
+
+    return n;
+}
+
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    ssize_t n;
+
+    while ((n = real_sys_writev(fd, iov, iovcnt)) < 0) {
+        if (EINTR == errno)
+            continue;
+
+        if (!fd_not_ready())
+            return -1;
+
+        int ret = wait_fd_event(fd, EVENT_WRITABLE, event_rw_callback,
+                                g_write_timeout);
+        if (ret)
+            return ret;
+    }
+
+    return n;
+}
 
-        schedule_timeout(SEND_TIMEOUT);
-        del_fd_event(sockfd, EVENT_WRITABLE);
-        if (is_wakeup_by_timeout()) {
-            errno = ETIME;
+ssize_t sendmsg(int sockfd, const struct msghdr *msg, int flags)
+{
+    ssize_t n;
+
+    if (uring_enabled()) {
+        n = uring_sendmsg(sockfd, msg, flags, g_write_timeout);
+        if (n < 0 && ETIME == errno)
             return -3;
+        return n;
+    }
+
+    while ((n = real_sys_sendmsg(sockfd, msg, flags)) < 0) {
+        if (EINTR == errno)
+            continue;
+
+        if (!fd_not_ready())
+            return -1;
+
+        int ret = wait_fd_event(sockfd, EVENT_WRITABLE, event_rw_callback,
+                                g_write_timeout);
+        if (ret)
+            return ret;
+    }
+
+    return n;
+}
+
+/* @in_fd is a file, so only the socket @out_fd can run out of room */
+ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count)
+{
+    ssize_t n;
+
+    while ((n = real_sys_sendfile(out_fd, in_fd, offset, count)) < 0) {
+        if (EINTR == errno)
+            continue;
+
+        if (!fd_not_ready())
+            return -1;
+
+        int ret = wait_fd_event(out_fd, EVENT_WRITABLE, event_rw_callback,
+                                g_write_timeout);
+        if (ret)
+            return ret;
+    }
+
+    return n;
+}
+
+/* EAGAIN from splice() does not tell which end was not ready: ask both, and
+ * wait for the first one that is not.
+ */
+static int wait_splice_event(int fd_in, int fd_out)
+{
+    struct pollfd fds[2] = {
+        {.fd = fd_in, .events = POLLIN},
+        {.fd = fd_out, .events = POLLOUT},
+    };
+
+    if (real_sys_poll(fds, 2, 0) < 0)
+        return -1;
+
+    if (!fds[0].revents)
+        return wait_fd_event(fd_in, EVENT_READABLE, event_rw_callback,
+                             g_read_timeout);
+    if (!fds[1].revents)
+        return wait_fd_event(fd_out, EVENT_WRITABLE, event_rw_callback,
+                             g_write_timeout);
+
+    return 0; /* both became ready meanwhile */
+}
+
+ssize_t splice(int fd_in,
+               loff_t *off_in,
+               int fd_out,
+               loff_t *off_out,
+               size_t len,
+               unsigned int flags)
+{
+    ssize_t n;
+
+    while ((n = real_sys_splice(fd_in, off_in, fd_out, off_out, len,
+                                flags)) < 0) {
+        if (EINTR == errno)
+            continue;
+
+        if (!fd_not_ready())
+            return -1;
+
+        int ret = wait_splice_event(fd_in, fd_out);
+        if (ret)
+            return ret;
+    }
+
+    return n;
+}
+
+/* Sleep the current coroutine until @until, in milliseconds, unless its
+ * deadline comes first. Return the milliseconds left to sleep.
+ */
+static long long sleep_until(long long until)
+{
+    long long now = get_curr_mseconds();
+
+    /* 0 still yields, somebody else may be waiting for the worker */
+    do {
+        long long left = until > now ? until - now : 0;
+        int timeout = coro_timeout(left > WAIT_SLICE ? WAIT_SLICE : left);
+        if (timeout < 0)
+            return left;
+
+        schedule_timeout(timeout);
+        is_wakeup_by_timeout();
+    } while ((now = get_curr_mseconds()) < until);
+
+    return 0;
+}
+
+int nanosleep(const struct timespec *req, struct timespec *rem)
+{
+    if (!in_coroutine())
+        return real_sys_nanosleep(req, rem);
+
+    if (req->tv_sec < 0 || req->tv_nsec < 0 || req->tv_nsec >= 1000000000L) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* the timer wheel ticks in milliseconds, round up */
+    long long left = sleep_until(get_curr_mseconds() + req->tv_sec * 1000LL +
+                                 (req->tv_nsec + 999999) / 1000000);
+    if (rem) {
+        rem->tv_sec = left / 1000;
+        rem->tv_nsec = left % 1000 * 1000000;
+    }
+
+    if (left) { /* cut short by the deadline */
+        errno = EINTR;
+        return -1;
+    }
+
+    return 0;
+}
+
+int usleep(useconds_t usec)
+{
+    if (!in_coroutine())
+        return real_sys_usleep(usec);
+
+    if (sleep_until(get_curr_mseconds() + (usec + 999) / 1000)) {
+        errno = EINTR;
+        return -1;
+    }
+
+    return 0;
+}
+
+unsigned int sleep(unsigned int seconds)
+{
+    if (!in_coroutine())
+        return real_sys_sleep(seconds);
+
+    return (sleep_until(get_curr_mseconds() + seconds * 1000LL) + 999) / 1000;
+}
+
+/* One coroutine waits on several fds, and more than one of them may fire in
+ * the same event cycle: only the first wakes it up. Kept off the coroutine
+ * stack, which may be shared and overwritten while the waiter sleeps.
+ */
+struct poll_waiter {
+    void *coro;
+    bool woken;
+};
+
+static void event_poll_callback(void *args)
+{
+    struct poll_waiter *waiter = args;
+
+    if (!waiter->woken) {
+        waiter->woken = true;
+        wakeup_coro(waiter->coro);
+    }
+}
+
+static inline event_t poll_events(short events)
+{
+    event_t what = EVNET_NONE;
+
+    if (events & (POLLIN | POLLPRI))
+        what |= EVENT_READABLE;
+    if (events & POLLOUT)
+        what |= EVENT_WRITABLE;
+
+    return what;
+}
+
+/* Park until one of @fds may be ready or @milliseconds pass. fds that the
+ * event loop cannot watch, such as regular files, are always ready for poll.
+ */
+static void wait_poll_fds(struct pollfd *fds, nfds_t nfds, int milliseconds)
+{
+    struct poll_waiter *waiter = malloc(sizeof(struct poll_waiter));
+    nfds_t i = 0;
+
+    if (!waiter) { /* nothing to watch with, just come back soon */
+        schedule_timeout(milliseconds > 10 ? 10 : milliseconds);
+        is_wakeup_by_timeout();
+        return;
+    }
+
+    waiter->coro = current_coro();
+    waiter->woken = false;
+    for (; i < nfds; i++) {
+        event_t what = poll_events(fds[i].events);
+        if (fds[i].fd < 0 || !what)
+            continue;
+
+        if (is_fd_event_registered(fds[i].fd))
+            park_fd_event(fds[i].fd, what, event_poll_callback, waiter);
+        else if (add_fd_event(fds[i].fd, what, event_poll_callback, waiter))
+            break;
+    }
+
+    /* an fd could not be watched, come back soon rather than never */
+    if (i < nfds && milliseconds > 10)
+        milliseconds = 10;
+
+    schedule_timeout(milliseconds);
+    is_wakeup_by_timeout();
+
+    while (i--) {
+        event_t what = poll_events(fds[i].events);
+        if (fds[i].fd < 0 || !what)
+            continue;
+
+        if (is_fd_event_registered(fds[i].fd))
+            unpark_fd_event(fds[i].fd, what);
+        else
+            del_fd_event(fds[i].fd, what);
+    }
+    free(waiter);
+}
+
+int poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+    if (!in_coroutine() || !timeout)
+        return real_sys_poll(fds, nfds, timeout);
+
+    long long deadline = get_curr_mseconds() + timeout;
+    for (;;) {
+        int n = real_sys_poll(fds, nfds, 0);
+        if (n)
+            return n;
+
+        long long left = WAIT_SLICE;
+        if (timeout > 0) {
+            left = deadline - get_curr_mseconds();
+            if (left <= 0)
+                return 0;
+        }
+
+        /* the coroutine's deadline ends even an endless poll */
+        int ms = coro_timeout(left > WAIT_SLICE ? WAIT_SLICE : left);
+        if (ms < 0)
+            return 0;
+
+        wait_poll_fds(fds, nfds, ms);
+    }
+}
+
+/* Implemented with poll(): fd_set is too large for coroutine stacks to copy
+ * around, so the pollfd array is allocated for the fds actually set.
+ */
+int select(int nfds,
+           fd_set *readfds,
+           fd_set *writefds,
+           fd_set *exceptfds,
+           struct timeval *timeout)
+{
+    if (!in_coroutine() || nfds <= 0 || nfds > FD_SETSIZE)
+        return real_sys_select(nfds, readfds, writefds, exceptfds, timeout);
+
+    int count = 0;
+    for (int fd = 0; fd < nfds; fd++) {
+        if ((readfds && FD_ISSET(fd, readfds)) ||
+            (writefds && FD_ISSET(fd, writefds)) ||
+            (exceptfds && FD_ISSET(fd, exceptfds)))
+            count++;
+    }
+
+    struct pollfd *fds = malloc((count ? count : 1) * sizeof(struct pollfd));
+    if (!fds) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for (int fd = 0, i = 0; fd < nfds; fd++) {
+        short events = 0;
+        if (readfds && FD_ISSET(fd, readfds))
+            events |= POLLIN;
+        if (writefds && FD_ISSET(fd, writefds))
+            events |= POLLOUT;
+        if (exceptfds && FD_ISSET(fd, exceptfds))
+            events |= POLLPRI;
+        if (events) {
+            fds[i].fd = fd;
+            fds[i++].events = events;
+        }
+    }
+
+    int ms = -1;
+    long long deadline = 0;
+    if (timeout) {
+        if (timeout->tv_sec < 0 || timeout->tv_usec < 0) {
+            free(fds);
+            errno = EINVAL;
+            return -1;
+        }
+        long long wait = timeout->tv_sec * 1000LL +
+                         (timeout->tv_usec + 999) / 1000;
+        deadline = get_curr_mseconds() + wait;
+        ms = wait > INT_MAX ? INT_MAX : wait;
+    }
+
+    int n = poll(fds, count, ms);
+    if (n < 0) {
+        free(fds);
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (fds[i].revents & POLLNVAL) {
+            free(fds);
+            errno = EBADF;
+            return -1;
+        }
+    }
+
+    n = 0;
+    for (int i = 0; i < count; i++) {
+        int fd = fds[i].fd;
+        short revents = fds[i].revents;
+
+        if (readfds && FD_ISSET(fd, readfds)) {
+            if (revents & (POLLIN | POLLHUP | POLLERR))
+                n++;
+            else
+                FD_CLR(fd, readfds);
+        }
+        if (writefds && FD_ISSET(fd, writefds)) {
+            if (revents & (POLLOUT | POLLERR))
+                n++;
+            else
+                FD_CLR(fd, writefds);
         }
+        if (exceptfds && FD_ISSET(fd, exceptfds)) {
+            if (revents & POLLPRI)
+                n++;
+            else
+                FD_CLR(fd, exceptfds);
+        }
+    }
+    free(fds);
+
+    /* Linux reports the time not slept */
+    if (timeout) {
+        long long left = deadline - get_curr_mseconds();
+        if (left < 0)
+            left = 0;
+        timeout->tv_sec = left / 1000;
+        timeout->tv_usec = (left % 1000) * 1000;
     }
 
     return n;
@@ -227,10 +956,30 @@ __INIT static void syscall_hook_init()
 {
     HOOK_SYSCALL(connect);
     HOOK_SYSCALL(accept);
+    HOOK_SYSCALL(accept4);
 
     HOOK_SYSCALL(read);
     HOOK_SYSCALL(recv);
+    HOOK_SYSCALL(readv);
+    HOOK_SYSCALL(recvmsg);
 
     HOOK_SYSCALL(write);
     HOOK_SYSCALL(send);
+    HOOK_SYSCALL(writev);
+    HOOK_SYSCALL(sendmsg);
+
+    HOOK_SYSCALL(sendfile);
+    HOOK_SYSCALL(splice);
+
+    HOOK_SYSCALL(sleep);
+    HOOK_SYSCALL(usleep);
+    HOOK_SYSCALL(nanosleep);
+    HOOK_SYSCALL(poll);
+    HOOK_SYSCALL(select);
+
+    HOOK_SYSCALL(open);
+    HOOK_SYSCALL(openat);
+    HOOK_SYSCALL(stat);
+    HOOK_SYSCALL(pread);
+    HOOK_SYSCALL(close);
 }
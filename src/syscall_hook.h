@@ -1,6 +1,13 @@
 #pragma once
 
+#include <poll.h>
+#include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
 
 typedef int (*sys_connect)(int sockfd,
                            const struct sockaddr *addr,
@@ -8,12 +15,61 @@ typedef int (*sys_connect)(int sockfd,
 typedef int (*sys_accept)(int sockfd,
                           struct sockaddr *addr,
                           socklen_t *addrlen);
+typedef int (*sys_accept4)(int sockfd,
+                           struct sockaddr *addr,
+                           socklen_t *addrlen,
+                           int flags);
 
 typedef ssize_t (*sys_read)(int fd, void *buf, size_t count);
 typedef ssize_t (*sys_recv)(int sockfd, void *buf, size_t len, int flags);
+typedef ssize_t (*sys_readv)(int fd, const struct iovec *iov, int iovcnt);
+typedef ssize_t (*sys_recvmsg)(int sockfd, struct msghdr *msg, int flags);
 
 typedef ssize_t (*sys_write)(int fd, const void *buf, size_t count);
 typedef ssize_t (*sys_send)(int sockfd, const void *buf, size_t len, int flags);
+typedef ssize_t (*sys_writev)(int fd, const struct iovec *iov, int iovcnt);
+typedef ssize_t (*sys_sendmsg)(int sockfd,
+                               const struct msghdr *msg,
+                               int flags);
+
+typedef ssize_t (*sys_sendfile)(int out_fd,
+                                int in_fd,
+                                off_t *offset,
+                                size_t count);
+typedef ssize_t (*sys_splice)(int fd_in,
+                              loff_t *off_in,
+                              int fd_out,
+                              loff_t *off_out,
+                              size_t len,
+                              unsigned int flags);
+
+typedef unsigned int (*sys_sleep)(unsigned int seconds);
+typedef int (*sys_usleep)(useconds_t usec);
+typedef int (*sys_nanosleep)(const struct timespec *req, struct timespec *rem);
+typedef int (*sys_poll)(struct pollfd *fds, nfds_t nfds, int timeout);
+typedef int (*sys_select)(int nfds,
+                          fd_set *readfds,
+                          fd_set *writefds,
+                          fd_set *exceptfds,
+                          struct timeval *timeout);
+
+typedef int (*sys_open)(const char *pathname, int flags, ...);
+typedef int (*sys_openat)(int dirfd, const char *pathname, int flags, ...);
+typedef int (*sys_stat)(const char *pathname, struct stat *statbuf);
+typedef ssize_t (*sys_pread)(int fd, void *buf, size_t count, off_t offset);
+typedef int (*sys_close)(int fd);
+
+/* TCP keep-alive idle time of client connections, in seconds */
+#define KEEP_ALIVE 60
+
+/* Park the current coroutine until socket @fd is readable or writable.
+ * Return 0 if ready, -3 on timeout and other negatives on failure.
+ * wait_fd_writable() expects the caller to have seen EAGAIN.
+ */
+int wait_fd_readable(int fd, int milliseconds);
+int wait_fd_writable(int fd, int milliseconds);
 
 /* declared in syscall_hook.c */
+extern sys_accept4 real_sys_accept4;
+extern sys_recv real_sys_recv;
 extern sys_write real_sys_write;
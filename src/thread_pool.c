@@ -0,0 +1,164 @@
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+
+#include "coro/sched.h"
+#include "event.h"
+#include "thread_pool.h"
+#include "util/list.h"
+
+#define THREAD_STACK_SIZE (64 * 1024)
+
+/* tasks cannot be abandoned, the waiter only wakes up now and then */
+#define TASK_WAIT_SLICE (60 * 1000)
+
+/* Lives on the stack of the waiting coroutine until @done */
+struct thread_job {
+    struct list_head list;
+    thread_task_t task;
+    void *args;
+    void *coro;
+    bool done;
+};
+
+struct thread_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct list_head pending;  /* queued by coroutines */
+    struct list_head finished; /* run, waiters not woken up yet */
+    int event_fd;
+    int nr_threads;
+};
+
+static struct thread_pool pool;
+
+bool thread_pool_enabled()
+{
+    return pool.nr_threads > 0;
+}
+
+static void *pool_thread(void *args)
+{
+    (void) args;
+
+    for (;;) {
+        pthread_mutex_lock(&pool.lock);
+        while (list_empty(&pool.pending))
+            pthread_cond_wait(&pool.cond, &pool.lock);
+
+        struct thread_job *job =
+            list_first_entry(&pool.pending, struct thread_job, list);
+        list_del(&job->list);
+        pthread_mutex_unlock(&pool.lock);
+
+        job->task(job->args);
+
+        pthread_mutex_lock(&pool.lock);
+        list_add_tail(&job->list, &pool.finished);
+        pthread_mutex_unlock(&pool.lock);
+
+        eventfd_write(pool.event_fd, 1);
+    }
+
+    return NULL;
+}
+
+/* Called by the event loop when the eventfd turns readable */
+static void pool_event_callback(void *args)
+{
+    struct list_head finished;
+    eventfd_t count;
+
+    (void) args;
+    eventfd_read(pool.event_fd, &count);
+
+    INIT_LIST_HEAD(&finished);
+    pthread_mutex_lock(&pool.lock);
+    list_splice_init(&pool.finished, &finished);
+    pthread_mutex_unlock(&pool.lock);
+
+    while (!list_empty(&finished)) {
+        struct thread_job *job =
+            list_first_entry(&finished, struct thread_job, list);
+        list_del(&job->list);
+        job->done = true;
+        wakeup_coro(job->coro);
+    }
+}
+
+int thread_pool_run(thread_task_t task, void *args)
+{
+    if (!pool.nr_threads)
+        return -1;
+
+    struct thread_job job = {
+        .task = task,
+        .args = args,
+        .coro = current_coro(),
+        .done = false,
+    };
+
+    pthread_mutex_lock(&pool.lock);
+    list_add_tail(&job.list, &pool.pending);
+    pthread_cond_signal(&pool.cond);
+    pthread_mutex_unlock(&pool.lock);
+
+    while (!job.done) {
+        schedule_timeout(TASK_WAIT_SLICE);
+        is_wakeup_by_timeout();
+    }
+
+    return 0;
+}
+
+/* Called by each worker process after the event loop is set up */
+void thread_pool_init(int nr_threads)
+{
+    if (!nr_threads)
+        return;
+
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+    INIT_LIST_HEAD(&pool.pending);
+    INIT_LIST_HEAD(&pool.finished);
+
+    pool.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (pool.event_fd < 0) {
+        printf("Failed to create eventfd: %s\n", strerror(errno));
+        exit(0);
+    }
+
+    if (add_fd_event(pool.event_fd, EVENT_READABLE, pool_event_callback,
+                     NULL)) {
+        printf("Failed to watch eventfd: %s\n", strerror(errno));
+        exit(0);
+    }
+
+    /* signals are handled by the worker thread only */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, THREAD_STACK_SIZE);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    for (int i = 0; i < nr_threads; i++) {
+        pthread_t tid;
+        int err = pthread_create(&tid, &attr, pool_thread, NULL);
+        if (err) {
+            printf("Failed to create pool thread: %s\n", strerror(err));
+            exit(0);
+        }
+    }
+
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    pool.nr_threads = nr_threads;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdbool.h>
+
+/* Per-worker thread pool for calls the event loop cannot wait on, such as
+ * reads of regular files. The calling coroutine parks until its task has run
+ * on a pool thread; completions are signalled through an eventfd watched by
+ * the event loop.
+ */
+typedef void (*thread_task_t)(void *args);
+
+bool thread_pool_enabled();
+
+/* Run @task(@args) on a pool thread and return once it is done.
+ * Return -1 if the pool is disabled, the caller then runs it inline.
+ */
+int thread_pool_run(thread_task_t task, void *args);
+
+void thread_pool_init(int nr_threads);
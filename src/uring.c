@@ -0,0 +1,600 @@
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "coro/sched.h"
+#include "event.h"
+#include "logger.h"
+#include "uring.h"
+#include "util/list.h"
+#include "util/memcache.h"
+
+#define ACCEPT_QUEUE_SIZE 64 /* connections taken by multishot accept */
+#define CANCEL_RETRY_MS 100  /* to queue a cancel again if the SQ was full */
+
+enum req_type {
+    REQ_ONESHOT = 0,
+    REQ_ACCEPT_MULTISHOT,
+    REQ_EPOLL, /* epoll fd of the event loop became readable */
+};
+
+/* Completion slot associated with each SQE through user_data. A one-shot
+ * request is waited for until its CQE arrives, even after its waiter gave
+ * up, since until then the kernel may still use the buffers it names.
+ */
+struct uring_req {
+    enum req_type type;
+    void *coro;
+    int res;
+    bool done;
+};
+
+struct uring_acceptor {
+    struct list_head list;
+    struct uring_req req;
+    int fd;
+    bool armed;
+    int error; /* last error reported by multishot accept */
+    int head, count;
+    int fds[ACCEPT_QUEUE_SIZE];
+    void *waiter;
+};
+
+struct uring {
+    int ring_fd;
+
+    /* submission queue */
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned to_submit;
+
+    /* completion queue */
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *ring_ptr;
+    size_t ring_size;
+
+    bool multishot_accept;
+    struct uring_req epoll_req;
+    bool epoll_armed;
+    struct list_head acceptors;
+    struct memcache *cache; /* caching request slots */
+};
+
+static struct uring uring;
+static bool enabled = false;
+
+static inline int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int io_uring_enter(unsigned to_submit,
+                                 unsigned min_complete,
+                                 unsigned flags,
+                                 void *arg,
+                                 size_t argsz)
+{
+    return syscall(__NR_io_uring_enter, uring.ring_fd, to_submit,
+                   min_complete, flags, arg, argsz);
+}
+
+bool uring_enabled()
+{
+    return enabled;
+}
+
+static void uring_submit()
+{
+    while (uring.to_submit) {
+        int ret = io_uring_enter(uring.to_submit, 0, 0, NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            ERR("io_uring_enter submit error: %s", strerror(errno));
+            return;
+        }
+        uring.to_submit -= ret;
+    }
+}
+
+/* SQEs are only published here; they reach the kernel in one batch from
+ * uring_cycle(), unless the submission queue runs full.
+ */
+static struct io_uring_sqe *get_sqe()
+{
+    unsigned tail = *uring.sq_tail;
+
+    if (tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE) >=
+        uring.sq_entries) {
+        uring_submit();
+        if (tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE) >=
+            uring.sq_entries)
+            return NULL;
+    }
+
+    unsigned index = tail & *uring.sq_mask;
+    struct io_uring_sqe *sqe = &uring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    uring.sq_array[index] = index;
+    __atomic_store_n(uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    uring.to_submit++;
+
+    return sqe;
+}
+
+static bool cancel_req(struct uring_req *req)
+{
+    struct io_uring_sqe *sqe = get_sqe();
+    if (!sqe)
+        return false;
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (unsigned long) req;
+    sqe->user_data = 0; /* completion ignored */
+    return true;
+}
+
+/* the SQE is consumed anyway, turn it into a no-op */
+static inline void drop_sqe(struct io_uring_sqe *sqe)
+{
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_NOP;
+}
+
+/* Sleep until the CQE of @sqe arrives, or the deadline of the coroutine.
+ * Return its result, or -ETIME if the request had to be cancelled.
+ */
+static int wait_sqe(struct io_uring_sqe *sqe, int milliseconds)
+{
+    if ((milliseconds = coro_timeout(milliseconds)) < 0) {
+        drop_sqe(sqe);
+        return -ETIME;
+    }
+
+    struct uring_req *req = memcache_alloc(uring.cache);
+    if (!req) {
+        drop_sqe(sqe);
+        return -ENOMEM;
+    }
+
+    req->type = REQ_ONESHOT;
+    req->coro = current_coro();
+    req->done = false;
+    sqe->user_data = (unsigned long) req;
+
+    schedule_timeout(milliseconds);
+    if (!req->done) {
+        /* Timed out, or woken up by somebody else. The request may still
+         * complete before the cancel reaches it, and then counts.
+         */
+        bool cancelling = false;
+        do {
+            if (!cancelling)
+                cancelling = cancel_req(req);
+            schedule_timeout(CANCEL_RETRY_MS);
+        } while (!req->done);
+
+        if (req->res == -ECANCELED || req->res == -EINTR)
+            req->res = -ETIME;
+    }
+
+    int res = req->res;
+    memcache_free(uring.cache, req);
+
+    return res;
+}
+
+static inline int result(int res)
+{
+    if (res >= 0)
+        return res;
+
+    errno = -res;
+    return -1;
+}
+
+int uring_poll(int fd, event_t what, int milliseconds)
+{
+    struct io_uring_sqe *sqe = get_sqe();
+    if (!sqe) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    if (what & EVENT_READABLE)
+        sqe->poll32_events |= POLLIN;
+    if (what & EVENT_WRITABLE)
+        sqe->poll32_events |= POLLOUT;
+
+    int res = wait_sqe(sqe, milliseconds);
+    return (res < 0) ? result(res) : 0;
+}
+
+/* Fall back to poll-then-retry on kernels that report EAGAIN for
+ * non-blocking sockets instead of arming the poll internally.
+ */
+static ssize_t uring_io(int opcode,
+                        int fd,
+                        void *buf,
+                        size_t len,
+                        int flags,
+                        event_t what,
+                        int milliseconds)
+{
+    for (;;) {
+        struct io_uring_sqe *sqe = get_sqe();
+        if (!sqe) {
+            errno = EBUSY;
+            return -1;
+        }
+
+        sqe->opcode = opcode;
+        sqe->fd = fd;
+        sqe->addr = (unsigned long) buf;
+        sqe->len = len;
+        sqe->msg_flags = flags;
+
+        int res = wait_sqe(sqe, milliseconds);
+        if (res != -EAGAIN)
+            return result(res);
+
+        if (uring_poll(fd, what, milliseconds))
+            return -1;
+    }
+}
+
+ssize_t uring_recv(int fd, void *buf, size_t len, int flags, int milliseconds)
+{
+    return uring_io(IORING_OP_RECV, fd, buf, len, flags, EVENT_READABLE,
+                    milliseconds);
+}
+
+ssize_t uring_send(int fd,
+                   const void *buf,
+                   size_t len,
+                   int flags,
+                   int milliseconds)
+{
+    return uring_io(IORING_OP_SEND, fd, (void *) buf, len, flags,
+                    EVENT_WRITABLE, milliseconds);
+}
+
+/* the vector of a message counts as one entry, as liburing does */
+ssize_t uring_recvmsg(int fd, struct msghdr *msg, int flags, int milliseconds)
+{
+    return uring_io(IORING_OP_RECVMSG, fd, msg, 1, flags, EVENT_READABLE,
+                    milliseconds);
+}
+
+ssize_t uring_sendmsg(int fd,
+                      const struct msghdr *msg,
+                      int flags,
+                      int milliseconds)
+{
+    return uring_io(IORING_OP_SENDMSG, fd, (void *) msg, 1, flags,
+                    EVENT_WRITABLE, milliseconds);
+}
+
+int uring_connect(int fd,
+                  const struct sockaddr *addr,
+                  socklen_t addrlen,
+                  int milliseconds)
+{
+    struct io_uring_sqe *sqe = get_sqe();
+    if (!sqe) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_CONNECT;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long) addr;
+    sqe->off = addrlen;
+
+    return result(wait_sqe(sqe, milliseconds));
+}
+
+static struct uring_acceptor *get_acceptor(int fd)
+{
+    struct uring_acceptor *acceptor;
+
+    list_for_each_entry (acceptor, &uring.acceptors, list) {
+        if (acceptor->fd == fd)
+            return acceptor;
+    }
+
+    acceptor = calloc(1, sizeof(struct uring_acceptor));
+    if (!acceptor)
+        return NULL;
+
+    acceptor->fd = fd;
+    acceptor->req.type = REQ_ACCEPT_MULTISHOT;
+    acceptor->req.coro = acceptor;
+    list_add(&acceptor->list, &uring.acceptors);
+
+    return acceptor;
+}
+
+static int pop_accepted(struct uring_acceptor *acceptor)
+{
+    int connfd = acceptor->fds[acceptor->head];
+
+    acceptor->head = (acceptor->head + 1) % ACCEPT_QUEUE_SIZE;
+    acceptor->count--;
+
+    return connfd;
+}
+
+static void accept_multishot_complete(struct uring_acceptor *acceptor,
+                                      struct io_uring_cqe *cqe)
+{
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        acceptor->armed = false;
+
+    if (cqe->res < 0) {
+        acceptor->error = cqe->res;
+    } else if (acceptor->count == ACCEPT_QUEUE_SIZE) {
+        WARN("multishot accept queue is full, drop fd:%d", cqe->res);
+        close(cqe->res);
+    } else {
+        int tail = (acceptor->head + acceptor->count) % ACCEPT_QUEUE_SIZE;
+        acceptor->fds[tail] = cqe->res;
+        acceptor->count++;
+    }
+
+    if (acceptor->waiter) {
+        wakeup_coro_priority(acceptor->waiter);
+        acceptor->waiter = NULL;
+    }
+}
+
+/* Multishot accept keeps one SQE armed per listen socket, and every CQE
+ * carries a new connection. The peer address is not reported that way, so
+ * callers asking for it get a one-shot accept.
+ */
+int uring_accept(int fd,
+                 struct sockaddr *addr,
+                 socklen_t *addrlen,
+                 int flags,
+                 int milliseconds)
+{
+    struct uring_acceptor *acceptor;
+
+    if (addr || !uring.multishot_accept || !(acceptor = get_acceptor(fd))) {
+        struct io_uring_sqe *sqe = get_sqe();
+        if (!sqe) {
+            errno = EBUSY;
+            return -1;
+        }
+
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = fd;
+        sqe->addr = (unsigned long) addr;
+        sqe->addr2 = (unsigned long) addrlen;
+        sqe->accept_flags = flags | SOCK_NONBLOCK;
+
+        return result(wait_sqe(sqe, milliseconds));
+    }
+
+    while (!acceptor->count) {
+        if (acceptor->error) {
+            int error = -acceptor->error;
+            acceptor->error = 0;
+
+            if (error == EINVAL && !acceptor->armed) {
+                /* multishot accept is not supported, Linux < 5.19 */
+                uring.multishot_accept = false;
+                return uring_accept(fd, addr, addrlen, flags, milliseconds);
+            }
+
+            errno = error;
+            return -1;
+        }
+
+        if (!acceptor->armed) {
+            struct io_uring_sqe *sqe = get_sqe();
+            if (!sqe) {
+                errno = EBUSY;
+                return -1;
+            }
+
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->fd = fd;
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            sqe->accept_flags = flags | SOCK_NONBLOCK;
+            sqe->user_data = (unsigned long) &acceptor->req;
+            acceptor->armed = true;
+        }
+
+        int timeout = coro_timeout(milliseconds);
+        if (timeout < 0) {
+            errno = ETIME;
+            return -1;
+        }
+
+        acceptor->waiter = current_coro();
+        schedule_timeout(timeout);
+        if (acceptor->waiter) {
+            acceptor->waiter = NULL;
+            errno = ETIME;
+            return -1;
+        }
+    }
+
+    return pop_accepted(acceptor);
+}
+
+/* Take a connection that multishot accept has already queued, if any */
+int uring_try_accept(int fd)
+{
+    struct uring_acceptor *acceptor;
+
+    list_for_each_entry (acceptor, &uring.acceptors, list) {
+        if (acceptor->fd == fd && acceptor->count)
+            return pop_accepted(acceptor);
+    }
+
+    errno = EAGAIN;
+    return -1;
+}
+
+static void arm_epoll()
+{
+    struct io_uring_sqe *sqe = get_sqe();
+    if (!sqe)
+        return;
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = event_loop_fd();
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = (unsigned long) &uring.epoll_req;
+    uring.epoll_armed = true;
+}
+
+static void handle_cqe(struct io_uring_cqe *cqe)
+{
+    struct uring_req *req = (struct uring_req *) (unsigned long) cqe->user_data;
+    if (!req)
+        return;
+
+    switch (req->type) {
+    case REQ_EPOLL:
+        uring.epoll_armed = false;
+        event_cycle(0);
+        break;
+
+    case REQ_ACCEPT_MULTISHOT:
+        accept_multishot_complete(req->coro, cqe);
+        break;
+
+    case REQ_ONESHOT:
+        req->res = cqe->res;
+        req->done = true;
+        wakeup_coro(req->coro);
+        break;
+    }
+}
+
+static void reap_cqes()
+{
+    unsigned head = *uring.cq_head;
+    unsigned tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++)
+        handle_cqe(&uring.cqes[head & *uring.cq_mask]);
+
+    __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* Scheduler policy: submit everything queued during this iteration and wait
+ * for completions with one io_uring_enter().
+ */
+void uring_cycle(int ms /* in milliseconds */)
+{
+    /* fds watched through the event loop, e.g. by add_fd_event() */
+    if (!uring.epoll_armed)
+        arm_epoll();
+
+    struct __kernel_timespec ts = {
+        .tv_sec = ms / 1000,
+        .tv_nsec = (ms % 1000) * 1000000L,
+    };
+    struct io_uring_getevents_arg arg = {
+        .ts = (unsigned long) &ts,
+    };
+
+    unsigned flags = IORING_ENTER_EXT_ARG;
+    unsigned min_complete = 0;
+    if (ms != 0 && *uring.cq_head == *uring.cq_tail) {
+        flags |= IORING_ENTER_GETEVENTS;
+        min_complete = 1;
+    }
+
+    int ret = io_uring_enter(uring.to_submit, min_complete, flags, &arg,
+                             sizeof(arg));
+    if (ret >= 0)
+        uring.to_submit -= ret;
+    else if (errno != ETIME && errno != EINTR)
+        ERR("io_uring_enter error: %s", strerror(errno));
+
+    reap_cqes();
+}
+
+void uring_init(int max_conn)
+{
+    unsigned entries = 64;
+    while (entries < (unsigned) max_conn && entries < 4096)
+        entries <<= 1;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    uring.ring_fd = io_uring_setup(entries, &p);
+    if (uring.ring_fd < 0) {
+        printf("Failed to set up io_uring: %s\n", strerror(errno));
+        exit(0);
+    }
+
+    if (!(p.features & IORING_FEAT_EXT_ARG) ||
+        !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        printf("io_uring engine requires Linux 5.11 or later\n");
+        exit(0);
+    }
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    uring.ring_size = (sq_size > cq_size) ? sq_size : cq_size;
+    uring.ring_ptr = mmap(NULL, uring.ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, uring.ring_fd,
+                          IORING_OFF_SQ_RING);
+    if (uring.ring_ptr == MAP_FAILED) {
+        printf("Failed to map io_uring rings: %s\n", strerror(errno));
+        exit(0);
+    }
+
+    uring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      uring.ring_fd, IORING_OFF_SQES);
+    if (uring.sqes == MAP_FAILED) {
+        printf("Failed to map io_uring SQEs: %s\n", strerror(errno));
+        exit(0);
+    }
+
+    char *ptr = uring.ring_ptr;
+    uring.sq_head = (unsigned *) (ptr + p.sq_off.head);
+    uring.sq_tail = (unsigned *) (ptr + p.sq_off.tail);
+    uring.sq_mask = (unsigned *) (ptr + p.sq_off.ring_mask);
+    uring.sq_array = (unsigned *) (ptr + p.sq_off.array);
+    uring.sq_entries = p.sq_entries;
+    uring.to_submit = 0;
+
+    uring.cq_head = (unsigned *) (ptr + p.cq_off.head);
+    uring.cq_tail = (unsigned *) (ptr + p.cq_off.tail);
+    uring.cq_mask = (unsigned *) (ptr + p.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe *) (ptr + p.cq_off.cqes);
+
+    uring.multishot_accept = true;
+    uring.epoll_req.type = REQ_EPOLL;
+    uring.epoll_armed = false;
+    INIT_LIST_HEAD(&uring.acceptors);
+
+    uring.cache = memcache_create(sizeof(struct uring_req), max_conn);
+    if (!uring.cache) {
+        printf("Failed to create cache for io_uring requests\n");
+        exit(0);
+    }
+
+    enabled = true;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "event.h"
+
+/* io_uring backend. Calls return -1 and set errno on failure, ETIME when
+ * @milliseconds elapse before the completion arrives.
+ */
+bool uring_enabled();
+
+int uring_accept(int fd,
+                 struct sockaddr *addr,
+                 socklen_t *addrlen,
+                 int flags,
+                 int milliseconds);
+int uring_try_accept(int fd);
+int uring_connect(int fd,
+                  const struct sockaddr *addr,
+                  socklen_t addrlen,
+                  int milliseconds);
+ssize_t uring_recv(int fd, void *buf, size_t len, int flags, int milliseconds);
+ssize_t uring_send(int fd,
+                   const void *buf,
+                   size_t len,
+                   int flags,
+                   int milliseconds);
+ssize_t uring_recvmsg(int fd, struct msghdr *msg, int flags, int milliseconds);
+ssize_t uring_sendmsg(int fd,
+                      const struct msghdr *msg,
+                      int flags,
+                      int milliseconds);
+int uring_poll(int fd, event_t what, int milliseconds);
+
+void uring_cycle(int milliseconds);
+void uring_init(int max_conn);
@@ -5,12 +5,13 @@
 
 #include "util/str.h"
 
-#define CONF_KV_LEN 64
+#define CONF_KEY_LEN 64
+#define CONF_VALUE_LEN 256 /* room for lists, e.g. of upstreams */
 
 struct conf {
     struct conf *next;
 
-    char key[CONF_KV_LEN], value[CONF_KV_LEN];
+    char key[CONF_KEY_LEN], value[CONF_VALUE_LEN];
 };
 
 static struct conf *config = NULL;
@@ -82,7 +83,7 @@ void load_conf(const char *filename)
         if (parse_conf((unsigned char *) buff, &key, &value))
             continue;
 
-        if (key.len >= CONF_KV_LEN || value.len >= CONF_KV_LEN) {
+        if (key.len >= CONF_KEY_LEN || value.len >= CONF_VALUE_LEN) {
             printf("config entry too long. [%.*s] [%.*s]\n", (int) key.len,
                    key.p, (int) value.len, value.p);
             fclose(fp);
@@ -88,6 +88,26 @@ static inline int list_empty(const struct list_head *head)
     return head->next == head;
 }
 
+/* join @list to the head of @head and reinitialize @list.
+ * @list: the new list to add.
+ * @head: the place to add it in the other list.
+ */
+static inline void list_splice_init(struct list_head *list,
+                                    struct list_head *head)
+{
+    if (list_empty(list))
+        return;
+
+    struct list_head *first = list->next, *last = list->prev;
+    struct list_head *at = head->next;
+
+    first->prev = head;
+    head->next = first;
+    last->next = at;
+    at->prev = last;
+    INIT_LIST_HEAD(list);
+}
+
 /* get the struct for this entry
  * @ptr:	the &struct list_head pointer.
  * @type:	the type of the struct this is embedded in.
@@ -27,6 +27,12 @@ static inline int enable_tcp_no_delay(int fd)
     return setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
 }
 
+/* hold back partial frames until uncorked, e.g. to merge header and body */
+static inline int set_tcp_cork(int fd, int on)
+{
+    return setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
 static inline int set_keep_alive(int fd, int interval)
 {
     int val = 1;
@@ -60,6 +66,15 @@ static inline int set_reuse_addr(int fd)
     return 0;
 }
 
+static inline int set_reuse_port(int fd)
+{
+    int val = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val)) < 0)
+        return -1;
+
+    return 0;
+}
+
 static unsigned fd_to_nl(int fd)
 {
     struct sockaddr_in sa;
@@ -47,3 +47,35 @@ static inline int str_atoi(str_t *s)
 
     return val;
 }
+
+/* value of the hex digit @ch, -1 if it is none */
+static inline int hex_value(unsigned char ch)
+{
+    switch (ch) {
+    case '0' ... '9':
+        return ch - '0';
+    case 'a' ... 'f':
+        return ch - 'a' + 10;
+    case 'A' ... 'F':
+        return ch - 'A' + 10;
+    default:
+        return -1;
+    }
+}
+
+/* decimal digits of @value at @p, return the end of them */
+static inline char *append_size(char *p, size_t value)
+{
+    char digits[20];
+    int n = 0;
+
+    do {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+
+    while (n)
+        *p++ = digits[--n];
+
+    return p;
+}
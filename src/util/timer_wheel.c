@@ -0,0 +1,244 @@
+#include "util/timer_wheel.h"
+
+#define TW_ROOT_MASK (TW_ROOT_SIZE - 1)
+#define TW_LEVEL_MASK (TW_LEVEL_SIZE - 1)
+
+/* bit shift of upper @level, 1 ~ TW_LEVELS - 1 */
+#define LEVEL_SHIFT(level) (TW_ROOT_BITS + ((level) -1) * TW_LEVEL_BITS)
+#define MAX_DELTA ((1LL << LEVEL_SHIFT(TW_LEVELS)) - 1)
+#define DUE_LEVEL TW_LEVELS /* on the due list, not in a slot */
+
+static inline struct list_head *slot_head(struct timer_wheel *tw,
+                                          int level,
+                                          int slot)
+{
+    return level ? &tw->levels[level - 1][slot] : &tw->root[slot];
+}
+
+static inline void set_slot_bit(struct timer_wheel *tw, int level, int slot)
+{
+    if (level)
+        tw->level_map[level - 1] |= 1ULL << slot;
+    else
+        tw->root_map[slot >> 6] |= 1ULL << (slot & 63);
+}
+
+static inline void clear_slot_bit(struct timer_wheel *tw, int level, int slot)
+{
+    if (level)
+        tw->level_map[level - 1] &= ~(1ULL << slot);
+    else
+        tw->root_map[slot >> 6] &= ~(1ULL << (slot & 63));
+}
+
+void timer_wheel_add(struct timer_wheel *tw, struct wheel_timer *timer)
+{
+    long long expires = timer->expires;
+    long long delta = expires - tw->now;
+    int level = 0, slot;
+
+    /* its tick was processed already: the next slot would be a tick late,
+     * the due list fires on the next advance
+     */
+    if (delta < 0) {
+        timer->level = DUE_LEVEL, timer->slot = 0;
+        list_add_tail(&timer->list, &tw->due);
+        tw->count++;
+        return;
+    }
+
+    if (delta > MAX_DELTA) /* parked at the top, cascaded again later */
+        expires = tw->now + MAX_DELTA, delta = MAX_DELTA;
+
+    if (delta < TW_ROOT_SIZE)
+        slot = expires & TW_ROOT_MASK;
+    else {
+        for (level = 1; level < TW_LEVELS - 1; level++) {
+            if (delta < 1LL << LEVEL_SHIFT(level + 1))
+                break;
+        }
+        slot = (expires >> LEVEL_SHIFT(level)) & TW_LEVEL_MASK;
+    }
+
+    timer->level = level, timer->slot = slot;
+    list_add_tail(&timer->list, slot_head(tw, level, slot));
+    set_slot_bit(tw, level, slot);
+    tw->count++;
+}
+
+void timer_wheel_del(struct timer_wheel *tw, struct wheel_timer *timer)
+{
+    if (!wheel_timer_pending(timer))
+        return;
+
+    list_del_init(&timer->list);
+    tw->count--;
+    if (timer->level != DUE_LEVEL &&
+        list_empty(slot_head(tw, timer->level, timer->slot)))
+        clear_slot_bit(tw, timer->level, timer->slot);
+}
+
+/* Move the timers of the current slot of @level one level down.
+ * Return the slot index, 0 means the next level has to be cascaded as well.
+ */
+static int cascade(struct timer_wheel *tw, int level)
+{
+    int slot = (tw->now >> LEVEL_SHIFT(level)) & TW_LEVEL_MASK;
+    struct list_head *head = slot_head(tw, level, slot);
+    struct list_head pending;
+
+    if (list_empty(head))
+        return slot;
+
+    /* detach the whole slot, re-adding may target the same list */
+    pending = *head;
+    pending.next->prev = &pending;
+    pending.prev->next = &pending;
+    INIT_LIST_HEAD(head);
+    clear_slot_bit(tw, level, slot);
+
+    while (!list_empty(&pending)) {
+        struct wheel_timer *timer =
+            list_first_entry(&pending, struct wheel_timer, list);
+        list_del_init(&timer->list);
+        tw->count--;
+        timer_wheel_add(tw, timer);
+    }
+
+    return slot;
+}
+
+/* first non-empty root slot at or after @from, TW_ROOT_SIZE if none */
+static int root_next(const struct timer_wheel *tw, int from)
+{
+    for (int word = from >> 6; word < TW_ROOT_SIZE / 64; word++) {
+        uint64_t bits = tw->root_map[word];
+        if (word == from >> 6)
+            bits &= ~0ULL << (from & 63);
+        if (bits)
+            return (word << 6) + __builtin_ctzll(bits);
+    }
+
+    return TW_ROOT_SIZE;
+}
+
+static void expire_list(struct timer_wheel *tw,
+                        struct list_head *head,
+                        timer_expire_t expire)
+{
+    while (!list_empty(head)) {
+        struct wheel_timer *timer =
+            list_first_entry(head, struct wheel_timer, list);
+        list_del_init(&timer->list);
+        tw->count--;
+        expire(timer);
+    }
+}
+
+static void expire_slot(struct timer_wheel *tw, int slot, timer_expire_t expire)
+{
+    clear_slot_bit(tw, 0, slot);
+    expire_list(tw, &tw->root[slot], expire);
+}
+
+/* Fire every timer due at or before @now. Empty stretches of the root level
+ * are skipped, only the slot boundaries are visited for cascading.
+ */
+void timer_wheel_advance(struct timer_wheel *tw,
+                         long long now,
+                         timer_expire_t expire)
+{
+    expire_list(tw, &tw->due, expire);
+
+    while (tw->now <= now) {
+        int index = tw->now & TW_ROOT_MASK;
+        if (!index && !cascade(tw, 1) && !cascade(tw, 2))
+            cascade(tw, 3);
+
+        if (!tw->count) {
+            tw->now = now + 1;
+            break;
+        }
+
+        int slot = root_next(tw, index);
+        if (tw->now - index + slot > now) {
+            tw->now = now + 1;
+            break;
+        }
+
+        tw->now += slot - index;
+        if (slot == TW_ROOT_SIZE) /* boundary, cascade first */
+            continue;
+
+        expire_slot(tw, slot, expire);
+        tw->now++;
+    }
+}
+
+/* Return the earliest tick at which a timer may fire, -1 if there is none.
+ * For timers on upper levels this is the start of their slot, where they get
+ * cascaded, which never lies after their expiry. Timers already due report
+ * the last tick processed, so that nobody waits for them.
+ */
+long long timer_wheel_next(const struct timer_wheel *tw)
+{
+    if (!tw->count)
+        return -1;
+    if (!list_empty(&tw->due))
+        return tw->now - 1;
+
+    int index = tw->now & TW_ROOT_MASK;
+    int slot = root_next(tw, index);
+    long long next = -1;
+    if (slot < TW_ROOT_SIZE) {
+        next = tw->now - index + slot;
+        if (index) /* no cascading pending before the root slot */
+            return next;
+    } else if (root_next(tw, 0) < TW_ROOT_SIZE) /* wrapped to next round */
+        next = tw->now - index + TW_ROOT_SIZE;
+
+    for (int level = 1; level < TW_LEVELS; level++) {
+        uint64_t map = tw->level_map[level - 1];
+        if (!map)
+            continue;
+
+        long long period = tw->now >> LEVEL_SHIFT(level);
+        int curr = period & TW_LEVEL_MASK;
+
+        /* slots from @first on are cascaded in this round; the current one
+         * only while its boundary has not been processed yet
+         */
+        int first = curr + !!(tw->now & ((1LL << LEVEL_SHIFT(level)) - 1));
+        uint64_t after = (first < TW_LEVEL_SIZE) ? map & (~0ULL << first) : 0;
+
+        long long start = period - curr;
+        if (after)
+            start += __builtin_ctzll(after);
+        else
+            start += TW_LEVEL_SIZE + __builtin_ctzll(map);
+        start <<= LEVEL_SHIFT(level);
+
+        if (next < 0 || start < next)
+            next = start;
+    }
+
+    return next;
+}
+
+void timer_wheel_init(struct timer_wheel *tw, long long now)
+{
+    tw->now = now;
+    tw->count = 0;
+    INIT_LIST_HEAD(&tw->due);
+
+    for (int i = 0; i < TW_ROOT_SIZE; i++)
+        INIT_LIST_HEAD(&tw->root[i]);
+    for (int i = 0; i < TW_ROOT_SIZE / 64; i++)
+        tw->root_map[i] = 0;
+
+    for (int level = 0; level < TW_LEVELS - 1; level++) {
+        for (int i = 0; i < TW_LEVEL_SIZE; i++)
+            INIT_LIST_HEAD(&tw->levels[level][i]);
+        tw->level_map[level] = 0;
+    }
+}
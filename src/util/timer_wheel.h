@@ -0,0 +1,58 @@
+#pragma once
+
+/* Hierarchical timing wheel with millisecond resolution.
+ *
+ * Level 0 has 256 slots of 1 ms, the upper levels 64 slots each, so timers
+ * up to 2^26 ms (about 18 hours) ahead are inserted and cancelled in O(1).
+ * Timers of upper levels are cascaded towards level 0 as time advances.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "util/list.h"
+
+#define TW_ROOT_BITS 8
+#define TW_LEVEL_BITS 6
+#define TW_ROOT_SIZE (1 << TW_ROOT_BITS)
+#define TW_LEVEL_SIZE (1 << TW_LEVEL_BITS)
+#define TW_LEVELS 4 /* root level included */
+
+struct wheel_timer {
+    struct list_head list;
+    long long expires; /* unit: milliseconds */
+    uint8_t level, slot;
+};
+
+struct timer_wheel {
+    long long now; /* next tick to be processed */
+    int count;     /* number of pending timers */
+
+    struct list_head due; /* added after their tick had passed */
+
+    struct list_head root[TW_ROOT_SIZE];
+    uint64_t root_map[TW_ROOT_SIZE / 64]; /* non-empty slots */
+
+    struct list_head levels[TW_LEVELS - 1][TW_LEVEL_SIZE];
+    uint64_t level_map[TW_LEVELS - 1];
+};
+
+typedef void (*timer_expire_t)(struct wheel_timer *timer);
+
+static inline void wheel_timer_init(struct wheel_timer *timer)
+{
+    INIT_LIST_HEAD(&timer->list);
+}
+
+static inline bool wheel_timer_pending(const struct wheel_timer *timer)
+{
+    return !list_empty(&timer->list);
+}
+
+void timer_wheel_init(struct timer_wheel *tw, long long now);
+void timer_wheel_add(struct timer_wheel *tw, struct wheel_timer *timer);
+void timer_wheel_del(struct timer_wheel *tw, struct wheel_timer *timer);
+void timer_wheel_advance(struct timer_wheel *tw,
+                         long long now,
+                         timer_expire_t expire);
+long long timer_wheel_next(const struct timer_wheel *tw);